@@ -0,0 +1,43 @@
+#ifndef AD_BATCH_H
+#define AD_BATCH_H
+
+#include <vector>
+
+#include "pack.hpp"
+#include "som.hpp"
+
+#if defined(__AVX512F__)
+#define AD_BATCH_LANES 16
+#else
+#define AD_BATCH_LANES 8
+#endif
+
+// Many small maps trained side by side, one per lane. Models with the same number of features are packed
+// into groups of AD_BATCH_LANES, and every buffer in a group is interleaved so that the same value of each
+// model sits in adjacent lanes: weights[cluster][feature][lane], inputs[row][feature][lane]. The inner loops
+// all run across lanes, so one vector instruction advances the whole group. Each model keeps its own rows and
+// its own convergence check; lanes whose model has run out of rows or has converged are masked off.
+//
+// Every model is trained exactly as ad_train would train it with the same config, except that rows are
+// visited in file order. Batch updates are applied once per epoch, so that only changes rounding.
+struct batch_model_t {
+	char input_path  [AD_PATH_SIZE] = { 0 };
+	char output_path [AD_PATH_SIZE] = { 0 };
+	ad_featurized_header header;
+	float32 error = 0;
+	uint32 iterations = 0;
+};
+
+struct batch_group_t {
+	uint32 models [AD_BATCH_LANES];
+	uint32 count = 0;
+	uint32 rows = 0; // The most rows of any model in the group
+	uint32 cols = 0;
+};
+
+bool batch_check_config(config_t* config);
+ad_return_t batch_load_manifest(const char* path, std::vector<batch_model_t>* models);
+void batch_group(std::vector<batch_model_t>* models, std::vector<batch_group_t>* groups);
+ad_return_t batch_train_group(config_t* config, batch_group_t* group, batch_model_t* models);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef AD_CHECKPOINT_H
+#define AD_CHECKPOINT_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "som.hpp"
+#include "projection.hpp"
+
+// A checkpoint holds everything needed to pick training back up where it left off: the weights, the
+// iteration (which drives the learning rate schedule), the last epoch's error (which drives the stopping
+// test), the generator state and the input order. k-means also needs how much each unit has absorbed (its
+// learning rate), and a map trained on reduced inputs needs the projection its weights live behind, since
+// fitting it again needn't give the same basis. The file is this header, then the weights, then the input
+// order, then unit_counts uint32 counts, then the projection; the checksum covers everything after the header.
+struct ad_checkpoint_header {
+	static uint32 magic;
+	static uint32 version;
+
+	uint32 file_magic = 0;
+	uint32 file_version = 0;
+	uint32 rows = 0;
+	uint32 cols = 0;
+	uint32 clusters = 0;
+	uint32 iteration = 0;
+	float32 last_error = 0;
+	uint32 unit_counts = 0;
+	projection_kind projection = projection_kind::none;
+	uint32 input_cols = 0;
+	uint32 projection_nonzeros = 0;
+	uint64 projection_offset = 0;
+	rng_t rng;
+	uint64 checksum = 0;
+};
+
+// Writes checkpoints without stalling training. Saving copies the state into a snapshot buffer, which is
+// cheap next to an epoch, and a background thread writes the snapshot to a temporary file and renames it
+// over the checkpoint. If the previous write is still running, the new checkpoint is skipped.
+struct checkpoint_writer_t {
+	char path [AD_PATH_SIZE] = { 0 };
+	std::vector<char> snapshot;
+	std::thread thread;
+	std::atomic<bool> busy = false;
+};
+
+void ckpt_writer_init(checkpoint_writer_t* writer, const char* path);
+bool ckpt_save(checkpoint_writer_t* writer, som_t* som, float32 last_error);
+void ckpt_writer_wait(checkpoint_writer_t* writer);
+ad_return_t ckpt_load(som_t* som, const char* path, float32* last_error);
+
+// Read just the projection out of a checkpoint, so training can resume on the inputs projected exactly as
+// before. Returns AD_RETURN_SUCCESS with an empty projection if the checkpoint has none.
+ad_return_t ckpt_load_projection(projection_t* projection, const char* path);
+
+#endif
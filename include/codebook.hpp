@@ -0,0 +1,57 @@
+#ifndef AD_CODEBOOK_H
+#define AD_CODEBOOK_H
+
+#include "math.hpp"
+#include "som.hpp"
+
+#define AD_CODEBOOK_ALIGNMENT 64
+#define AD_CODEBOOK_MAX_RERANK 16
+#define AD_CODEBOOK_RERANK 4
+#define AD_CODEBOOK_MAX_COLS 4096 // Widest map scored through a codebook; the query is quantized on the stack
+
+// An int8 copy of a trained SOM's weights, for scoring. Each weight is stored as a signed byte times a
+// scale, where the scale is either per row (one per cluster) or per feature (one per column). Rows are
+// padded with zeros to a multiple of 64 bytes so that the dot product kernels never need a tail loop.
+struct codebook_t {
+	int8* data;
+	float32* scales;
+	float32* norms;    // Squared norm of each dequantized row
+	int32* sums;       // Sum of each row's bytes, to undo the unsigned bias of the VNNI kernel
+	uint32 rows;
+	uint32 cols;
+	uint32 stride;
+	bool per_feature;
+	uint32 rerank;                         // Candidates rescored against the float weights by cb_find_bmu
+	bmu_function dense_find_bmu = nullptr; // The SOM's own kernel, put back by som_codebook_free
+};
+
+// A query quantized to match a codebook. Per-feature scales are folded into the query before it's
+// quantized, so both kinds of codebook share one integer kernel.
+struct codebook_query_t {
+	int8* data;
+	float32 scale;
+	float32 norm;
+};
+
+void cb_init(codebook_t* cb, matrix_t& weights, bool per_feature);
+void cb_free(codebook_t* cb);
+uint32 cb_bytes(codebook_t* cb);
+void cb_query_init(codebook_t* cb, codebook_query_t* query);
+void cb_query_load(codebook_t* cb, vector_t& input, codebook_query_t* query);
+void cb_query_free(codebook_query_t* query);
+int32 cb_dot(codebook_t* cb, codebook_query_t* query, uint32 row);
+
+// Find the cluster nearest to the input using the int8 distances. If rerank is nonzero, that many of the
+// best approximate candidates are compared again against the float weights, so the winner is exact as long
+// as it was among them. The distance returned is squared.
+uint32 cb_find_winning_cluster(codebook_t* cb, codebook_query_t* query, matrix_t& weights, vector_t& input, uint32 rerank, float32* distance);
+
+// Score through the codebook instead of the dense kernels, with codebook = row or feature in the config.
+// som_codebook_init builds som->codebook and installs cb_find_bmu as the SOM's find_bmu, like the PQ index.
+// The int8 distances are squared Euclidean whatever the metric, so they only pick the rerank candidates;
+// those are then compared with the SOM's own metric, which is the distance reported.
+void cb_find_bmu(som_t* som, vector_t& input, bmu_t* bmu);
+void som_codebook_init(som_t* som, bool per_feature, uint32 rerank);
+void som_codebook_free(som_t* som);
+
+#endif
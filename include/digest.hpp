@@ -0,0 +1,34 @@
+#ifndef AD_DIGEST_H
+#define AD_DIGEST_H
+
+#include "types.hpp"
+
+#define AD_DIGEST_CENTROIDS 64
+#define AD_DIGEST_BUFFER 64
+#define AD_DIGEST_COMPRESSION 70 // Picked so the centroids stay under AD_DIGEST_CENTROIDS for any count
+
+// A merging t-digest: a streaming estimate of a distribution's quantiles in fixed space. Values are
+// buffered, and each time the buffer fills it's sorted and merged into a set of weighted centroids. The
+// centroids are kept small near the tails, so extreme quantiles like p99.9 stay accurate. It's plain old
+// data, so it can be copied into a model file as is, once it's been flushed. Weights are counts of values,
+// kept in float64 so they stay exact well past the 2^24 rows a float32 can count.
+struct tdigest_t {
+	float32 means   [AD_DIGEST_CENTROIDS];
+	float64 weights [AD_DIGEST_CENTROIDS];
+	float32 buffer  [AD_DIGEST_BUFFER];
+	uint32 centroids;
+	uint32 buffered;
+	float32 min;
+	float32 max;
+	float64 total; // Weight of the centroids, not counting the buffer
+};
+
+void td_init(tdigest_t* td);
+void td_add(tdigest_t* td, float32 value);
+void td_flush(tdigest_t* td);
+float64 td_count(tdigest_t* td);
+
+// Quantiles can only be read from a flushed digest, so that reading never writes (e.g. to a mapped model)
+float32 td_quantile(tdigest_t* td, float64 q);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef AD_DRIFT_H
+#define AD_DRIFT_H
+
+#include <bit>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "array.hpp"
+#include "model.hpp"
+
+#define AD_DRIFT_BINS 16
+#define AD_DRIFT_WINDOW 65536
+#define AD_DRIFT_PSI .25f // The usual cutoff for a major shift
+#define AD_DRIFT_KS .1f
+#define AD_DRIFT_MIN_ROWS 256 // Fewer rows than this in a window and a unit's error shares are mostly noise
+
+// What scoring traffic looked like at training time: the share of training rows each unit won, and each unit's
+// training errors split into AD_DRIFT_BINS bins of equal probability, read off the unit's error digest in the
+// model. Each row is binned against its winner's edges, so a shift in one unit's errors shows up even when
+// other units shift the other way and the overall distribution stays put. Units that won nothing in training
+// use the edges of the model's overall error digest.
+//
+// With equal probability bins, the expected share of every bin is 1 / AD_DRIFT_BINS whatever mix of units the
+// rows came from, and the expected cumulative share at edge i is (i + 1) / AD_DRIFT_BINS, so only the edges
+// need storing. The last edge is infinity, which pads each unit's edges out to a whole vector; no score is
+// below it, even an infinite one, so bins stay in range.
+struct drift_baseline_t {
+	vector_t hit_rates;
+	float32* edges = nullptr; // clusters x AD_DRIFT_BINS, each unit's edges on their own 64 byte line
+};
+
+// Counts of scored rows per unit and error bin since the last check, clusters x AD_DRIFT_BINS; a unit's hits
+// are the sum of its bins. Observing a row is two increments and a handful of compares; everything else waits
+// for drift_check, once per window of rows. Give each scoring thread its own monitor and merge them before
+// checking.
+struct drift_monitor_t {
+	drift_baseline_t* baseline = nullptr;
+	array_t<uint32> bins;
+	uint32 rows = 0;
+};
+
+// How far one window of traffic is from the baseline. PSI (population stability index) compares the hit
+// shares and the error bins; KS (Kolmogorov-Smirnov) is the largest gap between the cumulative error shares.
+// The error statistics are taken per unit and averaged, weighted by rows, over the units with at least
+// AD_DRIFT_MIN_ROWS rows in the window; if none has that many, over the rows of all units pooled.
+struct drift_report_t {
+	uint32 rows = 0;
+	float32 hit_psi = 0;
+	float32 error_psi = 0;
+	float32 error_ks = 0;
+	bool retrain = false;
+};
+
+void drift_baseline_init(drift_baseline_t* baseline, ad_model_t* model);
+void drift_baseline_free(drift_baseline_t* baseline);
+void drift_init(drift_monitor_t* monitor, drift_baseline_t* baseline);
+void drift_free(drift_monitor_t* monitor);
+void drift_merge(drift_monitor_t* into, drift_monitor_t* from);
+
+// Compare the window against the baseline with the thresholds in config (drift_psi, drift_ks), then start a
+// new window. The report asks for a retrain if any statistic is past its threshold.
+drift_report_t drift_check(drift_monitor_t* monitor, config_t* config);
+
+// A row's bin is the number of its winner's edges below its score. With vectors, that's one compare against every edge
+// and a popcount, with no branches to mispredict; otherwise it's a branchless binary search.
+inline void drift_observe(drift_monitor_t* monitor, uint32 winner, float32 score) {
+	static_assert(AD_DRIFT_BINS == 16, "the search below is unrolled for 16 bins");
+	float32* edges = monitor->baseline->edges + winner * AD_DRIFT_BINS;
+#if defined(__AVX512F__)
+	uint32 bin = std::popcount((uint32)_mm512_cmp_ps_mask(_mm512_load_ps(edges), _mm512_set1_ps(score), _CMP_LT_OQ));
+#elif defined(__AVX2__)
+	__m256 x = _mm256_set1_ps(score);
+	uint32 low = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_load_ps(edges), x, _CMP_LT_OQ));
+	uint32 high = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_load_ps(edges + 8), x, _CMP_LT_OQ));
+	uint32 bin = std::popcount(low | high << 8);
+#else
+	uint32 bin = 0;
+	bin += (score > edges[bin + 7]) * 8;
+	bin += (score > edges[bin + 3]) * 4;
+	bin += (score > edges[bin + 1]) * 2;
+	bin += (score > edges[bin]);
+#endif
+
+	monitor->bins.data[winner * AD_DRIFT_BINS + bin]++;
+	monitor->rows++;
+}
+
+#endif
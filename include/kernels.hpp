@@ -0,0 +1,181 @@
+#ifndef AD_KERNELS_H
+#define AD_KERNELS_H
+
+#include <utility>
+#include <cmath>
+#include <float.h>
+
+#include "som.hpp"
+
+// Training kernels specialized on the distance metric and the number of features. With D known at compile
+// time, the loops over features unroll completely, the input row stays in registers for the whole search
+// over clusters, and partial sums are split across lanes instead of forming one long dependency chain.
+// som_select_kernels instantiates these for each metric and the common dimensions, and falls back to the
+// runtime-sized find_bmu_metric and calculate_weight_deltas for anything else.
+#define AD_KERNEL_LANES 8
+
+// Metrics are policies: what to accumulate for each feature, and how to turn the sum into a distance. Smaller
+// is closer for all of them. Only metrics whose terms can't be negative can give up on a distance early.
+// contribution is each feature's share of the finished distance, for attribution; the shares sum to it.
+// Every term is passed the feature's weight, but only weighted_l2 uses it.
+struct metric_l2sq {
+	static constexpr bool monotonic = true;
+	static float32 term(float32 x, float32 w, float32) { float32 d = x - w; return d * d; }
+	static float32 finish(float32 sum) { return sum; }
+	static float32 contribution(float32 x, float32 w, float32) { return term(x, w, 1); }
+};
+
+// Inputs are normalized, and apply_deltas renormalizes the weights for this metric, so 1 - x.w is the cosine
+// distance. For unit vectors that's also half the squared distance, which splits by feature without going negative.
+struct metric_cosine {
+	static constexpr bool monotonic = false;
+	static float32 term(float32 x, float32 w, float32) { return x * w; }
+	static float32 finish(float32 sum) { return 1 - sum; }
+	static float32 contribution(float32 x, float32 w, float32) { float32 d = x - w; return .5f * d * d; }
+};
+
+struct metric_l1 {
+	static constexpr bool monotonic = true;
+	static float32 term(float32 x, float32 w, float32) { return fabsf(x - w); }
+	static float32 finish(float32 sum) { return sum; }
+	static float32 contribution(float32 x, float32 w, float32) { return term(x, w, 1); }
+};
+
+struct metric_weighted_l2 {
+	static constexpr bool monotonic = true;
+	static float32 term(float32 x, float32 w, float32 feature_weight) { float32 d = x - w; return feature_weight * d * d; }
+	static float32 finish(float32 sum) { return sum; }
+	static float32 contribution(float32 x, float32 w, float32 feature_weight) { return term(x, w, feature_weight); }
+};
+
+template<uint32 D, typename F>
+inline void unroll(F&& f) {
+	[&]<uint32... I>(std::integer_sequence<uint32, I...>) {
+		(f(I), ...);
+	}(std::make_integer_sequence<uint32, D>());
+}
+
+template<typename Metric, uint32 D>
+inline float32 distance_n(const float32* a, const float32* b, const float32* feature_weights) {
+	constexpr uint32 lanes = D < AD_KERNEL_LANES ? D : AD_KERNEL_LANES;
+
+	float32 partial [lanes] = { 0 };
+	unroll<D>([&](uint32 i) {
+		partial[i % lanes] += Metric::term(a[i], b[i], feature_weights[i]);
+	});
+
+	float32 sum = 0;
+	unroll<lanes>([&](uint32 i) { sum += partial[i]; });
+	return Metric::finish(sum);
+}
+
+template<typename Metric>
+inline float32 distance(const float32* a, const float32* b, const float32* feature_weights, uint32 size) {
+	float32 partial [AD_KERNEL_LANES] = { 0 };
+	uint32 i = 0;
+	for (; i + AD_KERNEL_LANES <= size; i += AD_KERNEL_LANES) {
+		for (uint32 j = 0; j < AD_KERNEL_LANES; j++) partial[j] += Metric::term(a[i + j], b[i + j], feature_weights[i + j]);
+	}
+	for (; i < size; i++) partial[0] += Metric::term(a[i], b[i], feature_weights[i]);
+
+	float32 sum = 0;
+	for (uint32 j = 0; j < AD_KERNEL_LANES; j++) sum += partial[j];
+	return Metric::finish(sum);
+}
+
+// The distance, except that it stops as soon as the partial sum passes limit, when the metric allows it.
+// Checking once per eight features keeps the inner loop free of branches.
+template<typename Metric>
+float32 distance_bounded(som_t* som, const float32* input, const float32* weight, float32 limit) {
+	uint32 size = som->weights.cols;
+	const float32* feature_weights = som->feature_weights.data;
+	if (!Metric::monotonic) return distance<Metric>(input, weight, feature_weights, size);
+
+	float32 sum = 0;
+	uint32 i = 0;
+	for (; i + 8 <= size; i += 8) {
+		float32 partial = 0;
+		for (uint32 j = i; j < i + 8; j++) partial += Metric::term(input[j], weight[j], feature_weights[j]);
+		sum += partial;
+		if (sum > limit) return sum;
+	}
+	for (; i < size; i++) sum += Metric::term(input[i], weight[i], feature_weights[i]);
+	return sum;
+}
+
+// Each feature's share of the distance from input to weight. It's one more pass over a single unit, which is
+// still in cache from the winner search along with the input, and the loop has no dependencies between
+// features, so it vectorizes.
+template<typename Metric>
+void distance_contributions(som_t* som, const float32* input, const float32* weight, float32* contributions) {
+	const float32* feature_weights = som->feature_weights.data;
+	for (uint32 i = 0; i < som->weights.cols; i++) {
+		contributions[i] = Metric::contribution(input[i], weight[i], feature_weights[i]);
+	}
+}
+
+// Keep track of the two closest units seen so far
+inline void bmu_update(bmu_t* bmu, float32* second_distance, uint32 cluster, float32 distance) {
+	if (distance < bmu->distance) {
+		bmu->runner_up = bmu->winner;
+		*second_distance = bmu->distance;
+		bmu->winner = cluster;
+		bmu->distance = distance;
+	}
+	else if (distance < *second_distance) {
+		bmu->runner_up = cluster;
+		*second_distance = distance;
+	}
+}
+
+inline void bmu_init(bmu_t* bmu, float32* second_distance) {
+	bmu->winner = 0;
+	bmu->runner_up = 0;
+	bmu->distance = FLT_MAX;
+	*second_distance = FLT_MAX;
+}
+
+template<typename Metric, uint32 D>
+void find_bmu_n(som_t* som, vector_t& input, bmu_t* bmu) {
+	float32 x [D];
+	unroll<D>([&](uint32 i) { x[i] = input.data[i]; });
+
+	float32 second_distance;
+	bmu_init(bmu, &second_distance);
+
+	float32* weight = som->weights.data;
+	for (uint32 cluster = 0; cluster < som->weights.rows; cluster++, weight += D) {
+		bmu_update(bmu, &second_distance, cluster, distance_n<Metric, D>(x, weight, som->feature_weights.data));
+	}
+}
+
+template<typename Metric>
+void find_bmu_metric(som_t* som, vector_t& input, bmu_t* bmu) {
+	float32 second_distance;
+	bmu_init(bmu, &second_distance);
+
+	uint32 cols = som->weights.cols;
+	float32* weight = som->weights.data;
+	for (uint32 cluster = 0; cluster < som->weights.rows; cluster++, weight += cols) {
+		bmu_update(bmu, &second_distance, cluster, distance<Metric>(input.data, weight, som->feature_weights.data, cols));
+	}
+}
+
+template<uint32 D>
+void calculate_weight_deltas_n(som_t* som, som_worker_t* worker, vector_t& input, uint32 winning_cluster) {
+	float32 x [D];
+	unroll<D>([&](uint32 i) { x[i] = input.data[i]; });
+
+	float32 learning_rate = decayed_learning_rate(som);
+	for (uint32 cluster = 0; cluster < som->weights.rows; cluster++) {
+		float32 strength = ns_linear(winning_cluster, cluster, som->radius);
+		if (!strength) continue;
+
+		float32 rate = learning_rate * strength;
+		float32* weight = som->weights.data + cluster * D;
+		float32* delta = worker->deltas.data + cluster * D;
+		unroll<D>([&](uint32 i) { delta[i] += rate * (x[i] - weight[i]); });
+	}
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef AD_KMEANS_H
+#define AD_KMEANS_H
+
+#include "som.hpp"
+
+#define AD_KMEANS_BATCH 1024
+
+// Mini-batch k-means, for when the units only need to cover the data and the map's topology isn't wanted. It
+// trains the same som_t, with the same winner search, threads, inputs and stats, so the model it saves is
+// scored exactly like a map's.
+//
+// kmeans_seed replaces som_init's random weights with k-means++ seeds: each unit is an input, picked with
+// probability proportional to its distance from the units picked before it.
+//
+// Each epoch walks a fresh shuffle of the inputs in batches of batch_size. The workers find the batch's
+// winners against the weights as they were at the start of the batch, summing the inputs each unit won; then
+// each unit moves to absorb its share as a running mean, stepping by its batch hits over every hit it has had
+// so far (Sculley, "Web-scale k-means clustering"). There's no neighborhood, so a batch costs one winner
+// search per input and one update per winning unit. The epoch's errors and stats come from the winner search,
+// as in som_iterate; topographic error doesn't apply, and is zero.
+void kmeans_seed(som_t* som);
+som_epoch_t kmeans_iterate(som_t* som);
+
+#endif
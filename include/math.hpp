@@ -3,8 +3,6 @@
 
 #include "types.hpp"
 
-#define rand_float32(max) (static_cast<float32>(rand()) / static_cast<float32>(RAND_MAX / (max)))
-
 struct vector_t {
 	float32* data;
 	uint32 size;
@@ -40,4 +38,78 @@ void mtx_add(matrix_t& mtx, matrix_t& deltas);
 uint32 mtx_size(matrix_t& mtx);
 #define mtx_for(m, v) for (vector_t v = mtx_at(m, 0); v.data < m.data + (m.rows * m.cols); v.data = v.data + m.cols)
 
+
+// A row of a sparse matrix. Only the nonzero entries are stored; size is the logical (dense) dimension.
+struct sparse_vector_t {
+	float32* values;
+	uint32* indices;
+	uint32 nonzeros;
+	uint32 size;
+};
+
+float32 vec_length(sparse_vector_t& vec);
+void vec_normalize(sparse_vector_t& vec);
+float32 vec_dot(sparse_vector_t& sparse, vector_t& dense);
+#define spv_for(v, i) for (uint32 i = 0; i < v.nonzeros; i++)
+
+
+// Compressed sparse row matrix. Row i's nonzeros are values[offsets[i]] to values[offsets[i + 1]], and
+// columns holds the dense column of each of them.
+struct sparse_matrix_t {
+	float32* values;
+	uint32* columns;
+	uint32* offsets;
+	uint32 rows;
+	uint32 cols;
+	uint32 nonzeros;
+};
+
+void spm_init(sparse_matrix_t* spm, float32* values, uint32* columns, uint32* offsets, uint32 rows, uint32 cols);
+sparse_vector_t spm_at(sparse_matrix_t& spm, uint32 row);
+#define spm_for(m, v) for (uint32 _##v = 0; _##v < m.rows; _##v++) for (sparse_vector_t v = spm_at(m, _##v); v.size; v.size = 0)
+
+
+// Feature-major copy of a matrix, padded so each feature's column of values starts on a 64 byte boundary:
+// data[col * stride + row]. Used for the weights when there are few features, so a SIMD register holds
+// the same feature of 8 or 16 clusters instead of a handful of features from one cluster.
+#define AD_SOA_ALIGNMENT 64
+#define AD_SOA_LANES 16
+
+struct soa_matrix_t {
+	float32* data;
+	uint32 rows;
+	uint32 cols;
+	uint32 stride;
+};
+
+void soa_init(soa_matrix_t* soa, uint32 rows, uint32 cols);
+void soa_from_mtx(soa_matrix_t& soa, matrix_t& mtx);
+void soa_to_mtx(soa_matrix_t& soa, matrix_t& mtx);
+void soa_free(soa_matrix_t& soa);
+uint32 soa_find_nearest(soa_matrix_t& soa, vector_t& vec, float32* distance, uint32* runner_up);
+
+
+// Half precision storage. Rows are stored as 16-bit floats and widened to float32 a row at a time,
+// so a pass over the matrix reads half the bytes. Conversions use F16C / AVX2 when compiled for them.
+enum class half_format : uint8 {
+	fp16, // IEEE binary16
+	bf16  // The top half of a float32
+};
+
+float32 f16_to_f32(uint16 h);
+uint16 f32_to_f16(float32 f);
+float32 bf16_to_f32(uint16 h);
+uint16 f32_to_bf16(float32 f);
+
+struct half_matrix_t {
+	uint16* data;
+	uint32 rows;
+	uint32 cols;
+	half_format format;
+};
+
+void hmtx_init(half_matrix_t* mtx, matrix_t& source, half_format format);
+void hmtx_load(half_matrix_t& mtx, uint32 row, vector_t& out);
+void hmtx_free(half_matrix_t& mtx);
+
 #endif
\ No newline at end of file
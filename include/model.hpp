@@ -0,0 +1,72 @@
+#ifndef AD_MODEL_H
+#define AD_MODEL_H
+
+#include "som.hpp"
+#include "digest.hpp"
+#include "projection.hpp"
+
+#define AD_MODEL_ALIGNMENT 64
+
+enum class ad_topology : uint32 {
+	line, // Units sit on a line, and unit i neighbors units i - 1 and i + 1
+	none  // Units are independent, as k-means trains them
+};
+
+// A trained model on disk. Everything is stored exactly as it's used, so loading is just mapping the file and
+// pointing at the sections: the header (which includes the config the model was trained with), then the
+// weights starting on a 64 byte boundary, then one cluster_stats_t per unit, then digests of the squared
+// distance from each training row to its winner (one over all rows, then one per unit), from the last epoch. The checksum covers everything
+// after the header, but checking it means reading the whole file, so it's left to model_verify (ad_score -v,
+// ad_compress -v).
+//
+// A map trained on reduced inputs also stores its projection, starting on a 64 byte boundary after the
+// digests. cols is then the reduced width, and input_cols the width rows have to have to be scored.
+struct ad_model_header {
+	static uint32 magic;
+	static uint32 version;
+
+	uint32 file_magic = 0;
+	uint32 file_version = 0;
+	uint32 header_size = 0;
+	ad_topology topology = ad_topology::line;
+	uint32 clusters = 0;
+	uint32 cols = 0;
+	uint32 input_cols = 0;
+	projection_kind projection = projection_kind::none;
+	uint32 projection_nonzeros = 0;
+	uint64 weights_offset = 0;
+	uint64 stats_offset = 0;
+	uint64 digests_offset = 0;
+	uint64 projection_offset = 0;
+	uint64 file_size = 0;
+	uint64 checksum = 0;
+	config_t config;
+};
+
+struct ad_model_t {
+	void* data = nullptr;
+	uint64 size = 0;
+
+	ad_model_header* header = nullptr;
+	matrix_t weights;
+	cluster_stats_t* stats = nullptr;
+	tdigest_t* error_digest = nullptr;
+	tdigest_t* cluster_digests = nullptr;
+	projection_t projection;
+};
+
+ad_return_t model_save(som_t* som, const char* path);
+ad_return_t model_load(ad_model_t* model, const char* path);
+bool model_verify(ad_model_t* model);
+void model_free(ad_model_t* model);
+
+// Start training a SOM set up by som_init from a model's weights. Only the header is read to check that the
+// model fits, so an incompatible model is turned away without touching the rest of the file.
+ad_return_t model_warm_start(som_t* som, ad_model_t* model);
+
+// Set up a SOM for scoring with a loaded model. The weights point into the mapping, so the SOM can't be
+// trained further, and the model has to outlive it. If the model's config sets pq_subspaces, winners are
+// searched through a product quantization index built here. A model's projection is used from the mapping.
+void som_init(som_t* som, ad_model_t* model);
+
+#endif
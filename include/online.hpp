@@ -0,0 +1,64 @@
+#ifndef AD_ONLINE_H
+#define AD_ONLINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "som.hpp"
+
+#define AD_ONLINE_READERS 64
+
+// One published map. It's never modified once it's published; the trainer builds a new one instead. The map
+// is trained on its own copy of the window, which it keeps, so its winners, distances and stats stay valid.
+struct online_model_t {
+	som_t som;
+	std::vector<float32> inputs;
+	uint64 version = 0;
+};
+
+// A map that follows a stream of rows. Rows are pushed into a sliding window of the most recent window_rows;
+// after every retrain_interval new rows, a background thread trains a new map on a copy of the window, warm
+// started from the current map (see som_warm_start), for at most retrain_epochs epochs (zero means until the
+// error settles).
+//
+// The new map is published with a single atomic swap of current, so a reader sees either the old map or the
+// new one, never a mix. Readers never lock. Each one owns a hazard slot: it announces the map it's about to use
+// there and checks that it's still current, and the trainer only frees a retired map once no slot names it.
+struct online_trainer_t {
+	config_t config;
+	uint32 cols = 0;
+
+	// The window is only shared between the thread pushing rows and the trainer, which copies it out
+	std::mutex window_lock;
+	std::condition_variable window_changed;
+	std::vector<float32> window;
+	uint32 next = 0;
+	uint32 filled = 0;
+	uint32 pending = 0; // Rows pushed since the last copy
+	bool stopping = false;
+
+	std::atomic<online_model_t*> current { nullptr };
+	std::atomic<online_model_t*> hazards [AD_ONLINE_READERS] = {};
+	std::atomic<uint32> readers { 0 };
+	std::vector<online_model_t*> retired; // Only touched by the trainer thread
+	std::thread thread;
+};
+
+void online_start(online_trainer_t* trainer, config_t* config, uint32 cols);
+void online_push(online_trainer_t* trainer, float32* rows, uint32 count);
+void online_stop(online_trainer_t* trainer);
+
+// Each scoring thread takes a reader slot once, then brackets every use of a map with acquire and release.
+// acquire returns null until the first map is published.
+uint32 online_reader(online_trainer_t* trainer);
+online_model_t* online_acquire(online_trainer_t* trainer, uint32 reader);
+void online_release(online_trainer_t* trainer, uint32 reader);
+
+// Score rows against whichever map is current, on the calling thread. Returns the version of the map used,
+// or zero (and scores nothing) if there isn't one yet.
+uint64 online_predict(online_trainer_t* trainer, uint32 reader, matrix_t& rows, uint32* winners, float32* scores);
+
+#endif
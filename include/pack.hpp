@@ -1,6 +1,8 @@
 #ifndef AD_PACK_H
 #define AD_PACK_H
 
+#include <cstdio>
+
 #include "types.hpp"
 
 enum class ad_feature_type : int8 {
@@ -21,9 +23,72 @@ struct ad_feature {
 	ad_feature_type type;
 };
 
+// Dense datasets follow the header with a row-major array of floats. Sparse datasets follow it with
+// CSR arrays: (rows + 1) uint32 row offsets, then nonzeros uint32 columns, then nonzeros float values.
+enum class ad_featurized_layout : int32 {
+	ad_dense,
+	ad_sparse
+};
+
+// Files written before the header had a magic and version are rejected rather than misread; featurize
+// the raw data again to read them.
 struct ad_featurized_header {
+	static constexpr uint32 magic   = 0x54414546; // FEAT
+	static constexpr uint32 version = 1;
+
+	uint32 file_magic = magic;
+	uint32 file_version = version;
+	int32 rows = 0;
+	int32 features_per_row = 0;
+	ad_featurized_layout layout = ad_featurized_layout::ad_dense;
+	int32 nonzeros = 0;
+};
+
+// Whether size bytes hold a featurized dataset this build can read: the header matches, and the data it
+// describes is all there. Prints why not, naming path, if it isn't.
+inline bool featurized_valid(const ad_featurized_header* header, uint64 size, const char* path) {
+	bool valid = size >= sizeof(ad_featurized_header);
+	valid = valid && header->file_magic == ad_featurized_header::magic;
+	valid = valid && header->file_version == ad_featurized_header::version;
+	valid = valid && header->rows >= 0 && header->features_per_row >= 0 && header->nonzeros >= 0;
+	if (valid) {
+		uint64 data = header->layout == ad_featurized_layout::ad_sparse
+			? ((uint64)header->rows + 1) * sizeof(uint32) + (uint64)header->nonzeros * (sizeof(uint32) + sizeof(float32))
+			: (uint64)header->rows * header->features_per_row * sizeof(float32);
+		valid = size - sizeof(ad_featurized_header) >= data;
+	}
+	if (!valid) fprintf(stderr, "not a featurized dataset, or written by an incompatible version, path = %s\n", path);
+	return valid;
+}
+
+// Scores written by ad_score: the header, then rows uint32 winners, then rows float scores, then top_k
+// attribution_t per row if ad_score was asked for attributions. If ad_score was asked to flag outliers, rows
+// scoring above threshold are the flagged ones; otherwise threshold is zero.
+struct ad_scores_header {
+	int32 rows = 0;
+	int32 clusters = 0;
+	float32 threshold = 0;
+	int32 flagged = 0;
+	int32 top_k = 0;
+};
+
+// Rows encoded by ad_compress against a model. After the header come the sections, each one value per row:
+// winner ids (uint16, or uint32 for models with more than 65535 units), the length each row had before it
+// was normalized (float32), and its score against the model (bf16). With residuals, they're followed by a
+// float32 scale per row and then features_per_row int8 per row, the quantized difference between the
+// normalized row and its winner. Decoding needs the same model, which model_checksum identifies.
+struct ad_compressed_header {
+	static constexpr uint32 magic   = 0x504D4F43; // COMP
+	static constexpr uint32 version = 1;
+
+	uint32 file_magic = magic;
+	uint32 file_version = version;
 	int32 rows = 0;
 	int32 features_per_row = 0;
+	int32 clusters = 0;
+	int32 winner_bytes = 0;
+	int32 residuals = 0;
+	uint64 model_checksum = 0;
 };
 
 struct ad_pack_context {
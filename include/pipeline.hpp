@@ -5,10 +5,19 @@
 #include "som.hpp"
 #include <vector>
 
+// Featurized data in CSR form; see ad_featurized_header for how it's laid out on disk
+struct ad_sparse_buffer {
+	std::vector<uint32> offsets;
+	std::vector<uint32> columns;
+	std::vector<float32> values;
+};
+
 void ad_generate(config_t* config, char* buffer, uint32 buffer_size);
 void ad_featurize(config_t* config, std::vector<float32>* buffer);
 void ad_featurize(ad_unpack_context* context, std::vector<float32>* buffer, ad_featurized_header* header, bool quiet = true);
-void ad_train(som_t& som, ad_featurized_header* header, float32* input_data);
-void ad_train(som_t& som);
+void ad_featurize(ad_unpack_context* context, ad_sparse_buffer* buffer, ad_featurized_header* header, bool quiet = true);
+void ad_train(som_t& som, ad_featurized_header* header, float32* input_data, const char* resume_path = nullptr, const char* warm_path = nullptr);
+void ad_train(som_t& som, ad_featurized_header* header, sparse_matrix_t* inputs, const char* resume_path = nullptr, const char* warm_path = nullptr);
+void ad_train(som_t& som, const char* resume_path = nullptr, const char* warm_path = nullptr);
 
 #endif
@@ -19,4 +19,12 @@ namespace paths {
 
 void init_paths();
 
+// Move from over to, replacing to if it exists. Readers of to see either the old file or the new one. from is
+// flushed to disk first, so a crash can't leave to naming a file whose contents never got there.
+bool ad_replace_file(const char* from, const char* to);
+
+// Map a whole file read-only. Pages are shared through the page cache with every other process mapping it.
+void* ad_map_file(const char* path, uint64* size);
+void ad_unmap_file(void* data, uint64 size);
+
 #endif
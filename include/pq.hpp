@@ -0,0 +1,47 @@
+#ifndef AD_PQ_H
+#define AD_PQ_H
+
+#include "math.hpp"
+#include "som.hpp"
+
+#define AD_PQ_CENTROIDS 16 // Codes are 4 bits, so a subspace's distance table fits in one 16 byte register
+#define AD_PQ_BLOCK 32     // Units scanned together, one byte lane each
+#define AD_PQ_MAX_SUBSPACES 256
+#define AD_PQ_SHORTLIST 16
+#define AD_PQ_MAX_SHORTLIST 64
+#define AD_PQ_ITERATIONS 16
+
+// A product quantization index over a map's weights, for maps with many wide units. The features are split
+// into subspaces of equal width (the last one padded with zeros), and each unit is stored as one 4 bit code
+// per subspace: the nearest of that subspace's AD_PQ_CENTROIDS centroids, found by k-means over the units.
+//
+// A query first computes its squared distance to every centroid of every subspace, quantized to bytes, so
+// that a unit's approximate distance is the sum of one table entry per subspace. Codes are laid out in blocks
+// of AD_PQ_BLOCK units, two subspaces per byte, so a block's entries for a pair of subspaces are looked up for
+// all of its units at once by byte shuffles of the two tables. The closest shortlist units by that estimate
+// are then compared again with the map's own distance, so the winner is exact as long as it was shortlisted.
+// The estimate is squared Euclidean, whatever the metric; with other metrics it's only a guide to the shortlist.
+struct pq_index_t {
+	uint32 rows = 0;
+	uint32 cols = 0;
+	uint32 subspaces = 0; // Rounded up to an even number; a padding subspace is all zeros
+	uint32 width = 0;     // Features per subspace
+	uint32 shortlist = AD_PQ_SHORTLIST;
+	uint32 blocks = 0;
+	float32* centroids = nullptr; // subspaces x width x AD_PQ_CENTROIDS, so a feature's centroid values are adjacent
+	uint8* codes = nullptr;       // blocks x subspaces / 2 x AD_PQ_BLOCK
+	bmu_function dense_find_bmu = nullptr; // The SOM's own kernel, put back by som_pq_free
+};
+
+void pq_init(pq_index_t* pq, matrix_t& weights, uint32 subspaces, uint32 shortlist, uint64 seed);
+void pq_free(pq_index_t* pq);
+uint64 pq_bytes(pq_index_t* pq);
+
+// Score through the index instead of the dense kernels; som_pq_init builds som->pq and installs pq_find_bmu
+// as the SOM's find_bmu, so som_predict and everything else that searches for winners goes through it. The
+// seed picks the units k-means starts from; the same seed over the same weights gives the same index.
+void pq_find_bmu(som_t* som, vector_t& input, bmu_t* bmu);
+void som_pq_init(som_t* som, uint32 subspaces, uint32 shortlist, uint64 seed);
+void som_pq_free(som_t* som);
+
+#endif
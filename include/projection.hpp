@@ -0,0 +1,110 @@
+#ifndef AD_PROJECTION_H
+#define AD_PROJECTION_H
+
+#include <bit>
+#include <cmath>
+
+#include "som.hpp"
+
+#define AD_PROJECTION_NONZEROS 8     // Output features each input feature lands in, for random projections
+#define AD_PROJECTION_OVERSAMPLING 10 // Extra sketch columns beyond the components kept, for PCA
+#define AD_PROJECTION_SIGN 0x80000000
+
+// How wide rows are reduced before training, set by reduction in the config:
+// - random: a sparse Johnson-Lindenstrauss projection. Each input feature is added into AD_PROJECTION_NONZEROS
+//   output features picked at random, with random signs, scaled by 1 / sqrt(AD_PROJECTION_NONZEROS). Nothing
+//   is fitted, and distances between rows are kept to within a small factor with high probability.
+// - pca: the top principal directions of the normalized rows (uncentered, since rows are compared by
+//   direction), found in one pass over the data from a randomized sketch of their covariance (see proj_fit).
+enum class projection_kind : uint32 {
+	none,
+	random,
+	pca
+};
+
+// A linear map from input_cols features down to output_cols. Both kinds are stored by input feature, so
+// projecting a row only touches the entries of its nonzero features, and sparse rows never need expanding.
+struct projection_t {
+	projection_kind kind = projection_kind::none;
+	uint32 input_cols = 0;
+	uint32 output_cols = 0;
+	uint32 nonzeros = 0;           // random: input_cols x nonzeros output features, AD_PROJECTION_SIGN set when negated
+	uint32* indices = nullptr;
+	float32* components = nullptr; // pca: input_cols x output_cols
+	float32 explained = 0;         // pca: fraction of the rows' squared length the components keep, when fitted
+	bool owned = false;            // Loaded projections point into the model's mapping
+};
+
+// Set up the projection config asks for (reduction, reduced_dimensions), fitting it to the rows if it's PCA.
+// The rows have to be normalized already. Returns false, leaving the projection empty, if config doesn't ask
+// for a reduction or it wouldn't reduce anything.
+bool proj_fit(projection_t* projection, config_t* config, matrix_t& rows, uint32 threads);
+bool proj_fit(projection_t* projection, config_t* config, sparse_matrix_t& rows, uint32 threads);
+void proj_copy(projection_t* projection, projection_t* from);
+void proj_free(projection_t* projection);
+uint64 proj_bytes(projection_t* projection);
+const void* proj_data(projection_t* projection);
+void proj_view(projection_t* projection, projection_kind kind, uint32 input_cols, uint32 output_cols, uint32 nonzeros, void* data);
+
+// Project every row into output, which holds rows x output_cols floats
+void proj_rows(projection_t* projection, matrix_t& rows, float32* output, uint32 threads);
+void proj_rows(projection_t* projection, sparse_matrix_t& rows, float32* output, uint32 threads);
+
+// Project one row into output_cols floats. Scoring calls these per row, straight into the scratch row the
+// distance kernels read, so projected rows are never stored.
+inline void proj_apply(projection_t* projection, const float32* input, float32* output) {
+	uint32 k = projection->output_cols;
+	for (uint32 j = 0; j < k; j++) output[j] = 0;
+
+	for (uint32 i = 0; i < projection->input_cols; i++) {
+		float32 x = input[i];
+		if (!x) continue;
+
+		if (projection->kind == projection_kind::random) {
+			const uint32* indices = projection->indices + i * projection->nonzeros;
+			for (uint32 t = 0; t < projection->nonzeros; t++) {
+				uint32 sign = indices[t] & AD_PROJECTION_SIGN;
+				output[indices[t] & ~AD_PROJECTION_SIGN] += std::bit_cast<float32>(std::bit_cast<uint32>(x) ^ sign);
+			}
+		}
+		else {
+			const float32* component = projection->components + (uint64)i * k;
+			for (uint32 j = 0; j < k; j++) output[j] += x * component[j];
+		}
+	}
+
+	// The scale of a random projection is left off until the end; it doesn't matter to normalized rows, but
+	// keeps projected lengths comparable with the originals
+	if (projection->kind == projection_kind::random) {
+		float32 scale = 1 / sqrtf((float32)projection->nonzeros);
+		for (uint32 j = 0; j < k; j++) output[j] *= scale;
+	}
+}
+
+inline void proj_apply(projection_t* projection, sparse_vector_t& input, float32* output) {
+	uint32 k = projection->output_cols;
+	for (uint32 j = 0; j < k; j++) output[j] = 0;
+
+	spv_for(input, n) {
+		uint32 i = input.indices[n];
+		float32 x = input.values[n];
+		if (projection->kind == projection_kind::random) {
+			const uint32* indices = projection->indices + i * projection->nonzeros;
+			for (uint32 t = 0; t < projection->nonzeros; t++) {
+				uint32 sign = indices[t] & AD_PROJECTION_SIGN;
+				output[indices[t] & ~AD_PROJECTION_SIGN] += std::bit_cast<float32>(std::bit_cast<uint32>(x) ^ sign);
+			}
+		}
+		else {
+			const float32* component = projection->components + (uint64)i * k;
+			for (uint32 j = 0; j < k; j++) output[j] += x * component[j];
+		}
+	}
+
+	if (projection->kind == projection_kind::random) {
+		float32 scale = 1 / sqrtf((float32)projection->nonzeros);
+		for (uint32 j = 0; j < k; j++) output[j] *= scale;
+	}
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef AD_RANDOM_H
+#define AD_RANDOM_H
+
+#include "types.hpp"
+
+// xoshiro256** generator. Each SOM owns one, so nothing shares libc's rand() state (or its lock), and the
+// same config.seed always produces the same weights and input orders. Worker threads never draw from it:
+// every draw (initial weights, seeding, shuffles) happens on the training thread between passes, so the
+// random choices don't depend on how many threads there are.
+struct rng_t {
+	uint64 state [4];
+};
+
+void rng_seed(rng_t* rng, uint64 seed);
+uint64 rng_next(rng_t* rng);
+uint32 rng_below(rng_t* rng, uint32 bound);
+float32 rng_float32(rng_t* rng);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "math.hpp"
 #include "array.hpp"
+#include "random.hpp"
 
 struct config_t {
 	char name                  [64] = {0};
@@ -10,13 +11,46 @@ struct config_t {
 	char raw_data_file        [256] = {0};
 	char featurized_data_file [256] = {0};
 	char results_file         [256] = {0};
+	bool sparse                      = false;
 
+	char engine                 [16] = {0};
 	char neighborhood_function [256] = {0};
+	char input_precision        [16] = {0};
+	char weight_layout          [16] = {0};
+	char input_ordering         [16] = {0};
+	char metric                 [16] = {0};
+	char feature_weights       [256] = {0};
 	float32 learning_rate            =  0;
 	float32 decay_rate               =  0;
+	float32 neighborhood_radius      =  0;
+	float32 warm_learning_rate       =  0;
+	float32 warm_radius              =  0;
+	float32 warm_decay_rate          =  0;
 	uint32 count_clusters            =  0;
 	float32 error_threshold          =  0;
 	uint32 seed                      =  0;
+	char checkpoint_file      [256] = {0};
+	uint32 checkpoint_interval       =  0;
+	uint32 threads                   =  0;
+	bool compact                     = false;
+	float32 merge_distance           =  0;
+	uint32 batch_size                =  0;
+
+	uint32 window_rows               =  0;
+	uint32 retrain_interval          =  0;
+	uint32 retrain_epochs            =  0;
+
+	uint32 drift_window              =  0;
+	float32 drift_psi                =  0;
+	float32 drift_ks                 =  0;
+
+	uint32 pq_subspaces              =  0;
+	uint32 pq_shortlist              =  0;
+	char codebook               [16] = {0};
+	uint32 codebook_rerank           =  0;
+
+	char reduction              [16] = {0};
+	uint32 reduced_dimensions        =  0;
 
 	bool quiet        = false;
 	bool write_output = false;
@@ -26,9 +60,106 @@ void cfg_save(config_t* cfg, const char* path);
 void cfg_load(config_t* config, const char* path);
 
 
-typedef float32 (*ns_function)(uint32, uint32);
-float32 ns_linear(uint32 winning_cluster, uint32 neighbor_cluster);
-float32 ns_none(uint32 winning_cluster, uint32 neighbor_cluster);
+// Neighborhood functions: how strongly a unit is pulled toward an input, given the input's winner. Units
+// radius or more steps from the winner along the map aren't pulled at all.
+#define AD_NEIGHBORHOOD_RADIUS 2
+
+typedef float32 (*ns_function)(uint32, uint32, float32);
+float32 ns_linear(uint32 winning_cluster, uint32 neighbor_cluster, float32 radius);
+float32 ns_none(uint32 winning_cluster, uint32 neighbor_cluster, float32 radius);
+float32 som_neighborhood_radius(config_t* config);
+
+// How an epoch walks the shuffled inputs:
+// - indirect: look each row up through input_order. Every access is a random row of inputs.
+// - gather: copy blocks of shuffled rows into a contiguous staging buffer (prefetching ahead), then train on that
+// - block: shuffle runs of consecutive rows instead of single rows, so most accesses are sequential
+enum class input_ordering : uint8 {
+	indirect,
+	gather,
+	block
+};
+
+#define AD_ORDER_BLOCK 256
+#define AD_PREFETCH_DISTANCE 16
+
+// The distance winners are picked by. Inputs are normalized first in every case.
+// - l2sq: squared Euclidean distance, the default
+// - cosine: 1 - x.w
+// - l1: sum of absolute differences
+// - weighted_l2: squared Euclidean distance with each feature scaled by feature_weights (a comma separated list)
+enum class distance_metric : uint8 {
+	l2sq,
+	cosine,
+	l1,
+	weighted_l2
+};
+
+// What trains the units:
+// - som: a self-organizing map, the default. Units sit on a line and pull their neighbors along.
+// - kmeans: mini-batch k-means seeded with k-means++ (see kmeans.hpp). Units are independent, so there's no
+//   neighborhood to compute and no topology in the model.
+enum class som_engine : uint8 {
+	som,
+	kmeans
+};
+
+// The result of searching the map for an input's best matching unit. The runner up is the second closest
+// unit, which is what topographic error is measured with.
+struct bmu_t {
+	uint32 winner;
+	uint32 runner_up;
+	float32 distance; // Distance from the input to the winner under the SOM's metric (squared, for the L2 metrics)
+};
+
+// What one pass over the inputs measured along the way, against the weights as they were during the pass
+struct som_epoch_t {
+	float32 quantization_error = 0; // Sum of the distances from each input to its winner
+	float32 topographic_error  = 0; // Fraction of inputs whose two best units are not neighbors on the map
+};
+
+// How far one unit's inputs sit from it: hit count, and the mean, variance and max (radius) of their Euclidean
+// distances. Mean and variance are kept with Welford's method, as a running mean and the sum of squared
+// differences from it, so they're updated in one pass and merged across threads without losing precision.
+struct cluster_stats_t {
+	uint32 hits = 0;
+	float32 radius = 0;
+	float64 mean = 0;
+	float64 m2 = 0;
+};
+
+void cluster_stats_add(cluster_stats_t* stats, float32 distance);
+void cluster_stats_merge(cluster_stats_t* into, cluster_stats_t* from);
+void cluster_stats_reset(array_t<cluster_stats_t>* stats);
+float64 cluster_stats_variance(cluster_stats_t* stats);
+
+// Everything one training thread accumulates during an epoch. Each thread takes a contiguous slice of the
+// shuffled order; once the pass is done, the workers' deltas, errors and stats are added into the SOM's.
+// The first worker's deltas are the SOM's own, so a single thread accumulates exactly as it always has.
+struct som_worker_t {
+	matrix_t deltas;
+	vector_t delta_strength;
+	vector_t input_scratch;
+	matrix_t staging;
+	array_t<cluster_stats_t> stats;
+	som_epoch_t epoch;
+};
+
+struct som_t;
+struct pq_index_t;
+struct codebook_t;
+struct projection_t;
+typedef void (*bmu_function)(som_t*, vector_t&, bmu_t*);
+typedef void (*delta_function)(som_t*, som_worker_t*, vector_t&, uint32);
+typedef float32 (*bounded_function)(som_t*, const float32*, const float32*, float32);
+typedef void (*contribution_function)(som_t*, const float32*, const float32*, float32*);
+
+// The dense kernels used for training and scoring, chosen once per SOM by som_select_kernels
+struct som_kernels_t {
+	bmu_function find_bmu;
+	delta_function calculate_weight_deltas;
+	bounded_function distance_bounded;
+	contribution_function distance_contributions;
+};
 
 struct som_t {
     config_t config;
@@ -36,17 +167,118 @@ struct som_t {
     matrix_t inputs;
     matrix_t deltas;
     vector_t winners;
+    vector_t distances; // Squared distance from each input to its winner, as of the last epoch
 	array_t<uint32> input_order;
 	uint32 iteration = 0;
+	float32 radius = AD_NEIGHBORHOOD_RADIUS;
+	rng_t rng;
+	som_kernels_t kernels;
+	distance_metric metric = distance_metric::l2sq;
+	vector_t feature_weights;
+	input_ordering ordering = input_ordering::indirect;
+	som_engine engine = som_engine::som;
+
+	// With threads = n, each epoch is split across n workers; zero means one. Per-cluster stats are
+	// gathered by every epoch, so after training they describe the last one.
+	array_t<som_worker_t> workers;
+	array_t<cluster_stats_t> cluster_stats;
+
+	// Sparse inputs are kept in CSR form instead of in inputs. The sparse kernels expand the distance as
+	// ||x||^2 - 2x.w + ||w||^2, so they need each weight's squared norm, and they defer the dense -w half of
+	// each update to apply_deltas by accumulating the total step size per cluster.
+	bool is_sparse = false;
+	sparse_matrix_t sparse_inputs;
+	vector_t weight_norms;
+	vector_t delta_strength;
+
+	// With input_precision = fp16 or bf16, the normalized inputs are narrowed into half_inputs once at
+	// init, and each row is widened into its worker's input_scratch right before the kernels use it.
+	bool is_half = false;
+	half_matrix_t half_inputs;
+
+	// With weight_layout = soa, a feature-major copy of the weights is searched for winners instead of
+	// weights. Deltas still accumulate row-major, and the copy is refreshed whenever they're applied.
+	bool is_soa = false;
+	soa_matrix_t soa_weights;
+
+	// The order som_is_anomalous tries units in: most populated first, so normal rows usually stop at the
+	// first or second unit. Empty means index order.
+	array_t<uint32> probe_order;
+
+	// With engine = kmeans, how many inputs each unit has absorbed so far, which sets its learning rate
+	array_t<uint32> unit_counts;
+
+	// With pq_subspaces set, scoring searches for winners through a product quantization index (see pq.hpp)
+	pq_index_t* pq = nullptr;
+
+	// With codebook set (and no pq_subspaces), scoring searches for winners through an int8 copy of the weights
+	// (see codebook.hpp)
+	codebook_t* codebook = nullptr;
+
+	// With reduction set, the map is trained on projected inputs, and rows are projected the same way before
+	// they're scored (see projection.hpp)
+	projection_t* projection = nullptr;
 };
 
 void som_init(som_t* som, float32* input_data, uint32 rows, uint32 cols);
-void som_iterate(som_t* som);
+void som_init(som_t* som, sparse_matrix_t* inputs);
+void som_free(som_t* som);
+void som_warm_start(som_t* som, matrix_t& weights);
+distance_metric metric_from_name(const char* name); // Anything unrecognized is l2sq
+void som_select_kernels(som_t* som, uint32 features);
+void som_shuffle(som_t* som);
+som_epoch_t som_iterate(som_t* som);
+void som_iterate_gathered(som_t* som, som_worker_t* worker, uint32 begin, uint32 end);
+bool som_adjacent(uint32 a, uint32 b);
 float32 som_error(som_t* som);
+float32 som_stats_distance(som_t* som, float32 distance);
 float32 decayed_learning_rate(som_t* som);
 uint32 find_winning_cluster(som_t* som, vector_t& input);
-void calculate_weight_deltas(som_t* som, vector_t& input, uint32 winning_cluster);
+void find_bmu_soa(som_t* som, vector_t& input, bmu_t* bmu);
+void calculate_weight_deltas(som_t* som, som_worker_t* worker, vector_t& input, uint32 winning_cluster);
 float32 squared_error(vector_t& weight, vector_t& input);
 void apply_deltas(som_t* som);
+void update_weight_norms(som_t* som);
+void find_bmu(som_t* som, sparse_vector_t& input, bmu_t* bmu);
+void calculate_weight_deltas(som_t* som, som_worker_t* worker, sparse_vector_t& input, uint32 winning_cluster);
+float32 squared_error(vector_t& weight, float32 weight_norm, sparse_vector_t& input);
+
+// Shrink a trained map before it's saved: units that no input won are dropped, and each remaining unit closer
+// than merge_distance (Euclidean, between weights) to a unit already kept is folded into it, weighted by hits.
+// Kept units stay in order along the line. remap receives each old unit's new index, or AD_UNIT_PRUNED, and
+// then every input is assigned to its winner among the kept units, which refreshes winners, distances and
+// cluster stats. Returns the number of units kept. The map can't be trained any further afterwards.
+#define AD_UNIT_PRUNED 0xFFFFFFFF
+uint32 som_compact(som_t* som, float32 merge_distance, uint32* remap);
+void som_assign(som_t* som);
+
+// One feature's share of a row's score: its term of the distance to the winner, stored as fp16
+struct attribution_t {
+	uint16 feature;
+	uint16 contribution;
+};
+
+#define AD_ATTRIBUTION_NONE 0xFFFF
+#define AD_ATTRIBUTION_MAX 16
+
+// Score rows against a trained map. Rows are normalized into scratch space the same way som_init normalizes
+// training inputs, so the caller's data is left alone (and may be read-only). A row's score is its winner's
+// bmu_t::distance, i.e. its share of the quantization error. Zero threads means one per hardware thread.
+//
+// With top_k (at most AD_ATTRIBUTION_MAX), attributions receives top_k entries per row: the features that contributed the most to the
+// score, largest first. Rows with fewer than top_k features are padded with AD_ATTRIBUTION_NONE.
+//
+// If the map was trained on reduced inputs, each row is projected into the scratch row instead of copied, and
+// rows are then normalized in the reduced space; attributions name reduced features.
+void som_predict(som_t* som, matrix_t& rows, uint32* winners, float32* scores, uint32 threads = 0, attribution_t* attributions = nullptr, uint32 top_k = 0);
+void som_predict(som_t* som, sparse_matrix_t& rows, uint32* winners, float32* scores, uint32 threads = 0, attribution_t* attributions = nullptr, uint32 top_k = 0);
+
+// Threshold checks, for when the only question is whether a row is within threshold (in the same units as
+// the scores) of any unit. That only needs one unit close enough, so the search stops at the first one, tries
+// the caller's last hit and then the most populated units first, and gives up on each unit as soon as its
+// partial distance passes the threshold, if the metric allows it. The input has to be normalized already.
+void som_probe_order(som_t* som, uint32* hits);
+bool som_is_anomalous(som_t* som, vector_t& input, float32 threshold, uint32* last_hit);
+void som_flag_anomalies(som_t* som, matrix_t& rows, float32 threshold, uint8* flags, uint32 threads = 0);
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef AD_UTILS_H
+#define AD_UTILS_H
+
+#include <thread>
+#include <vector>
+
+#include "types.hpp"
+
+void memfill(void* dst, int32 size, void* pattern, int32 pattern_size);
+
+// Zeroed allocations aligned for SIMD loads. Free these with ad_aligned_free, not free.
+void* ad_aligned_alloc(uint64 size, uint64 alignment);
+void ad_aligned_free(void* data);
+uint64 ad_align(uint64 value, uint64 alignment);
+uint64 ad_hash(const void* data, uint64 size, uint64 hash = 0xCBF29CE484222325);
+
+// Split [0, count) into one contiguous range per thread and call f(begin, end, thread) for each. The last range
+// runs on the calling thread. Zero threads means one per hardware thread.
+template<typename F>
+void ad_parallel_for(uint32 count, uint32 threads, F&& f) {
+	if (!threads) threads = std::thread::hardware_concurrency();
+	if (threads > count) threads = count;
+	if (threads <= 1) { f(0, count, 0); return; }
+
+	uint32 chunk = (count + threads - 1) / threads;
+	auto range_end = [&](uint32 thread) { return chunk * (thread + 1) < count ? chunk * (thread + 1) : count; };
+
+	std::vector<std::thread> workers;
+	for (uint32 thread = 0; thread + 1 < threads; thread++) {
+		workers.emplace_back([&, thread]() { f(chunk * thread, range_end(thread), thread); });
+	}
+	f(chunk * (threads - 1) < count ? chunk * (threads - 1) : count, count, threads - 1);
+	for (auto& worker : workers) worker.join();
+}
+
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define ad_prefetch(address) _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#else
+#define ad_prefetch(address) __builtin_prefetch(address)
+#endif
+
+#endif
@@ -0,0 +1,434 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <float.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "types.hpp"
+#include "pack.hpp"
+#include "math.hpp"
+#include "som.hpp"
+#include "model.hpp"
+#include "batch.hpp"
+#include "utils.hpp"
+#include "platform.hpp"
+
+#define AD_FLAG_CONFIG "-c"
+#define AD_FLAG_MANIFEST "-m"
+#define AD_FLAG_THREADS "-t"
+#define AD_FLAG_HELP "-h"
+
+// One value per model in a group, in one vector register
+#if defined(__AVX512F__)
+typedef __m512 lanes_t;
+inline lanes_t lanes_load(const float32* p)            { return _mm512_load_ps(p); }
+inline void    lanes_store(float32* p, lanes_t a)      { _mm512_store_ps(p, a); }
+inline lanes_t lanes_set(float32 a)                    { return _mm512_set1_ps(a); }
+inline lanes_t lanes_add(lanes_t a, lanes_t b)         { return _mm512_add_ps(a, b); }
+inline lanes_t lanes_sub(lanes_t a, lanes_t b)         { return _mm512_sub_ps(a, b); }
+inline lanes_t lanes_mul(lanes_t a, lanes_t b)         { return _mm512_mul_ps(a, b); }
+inline lanes_t lanes_fmadd(lanes_t a, lanes_t b, lanes_t c) { return _mm512_fmadd_ps(a, b, c); }
+inline lanes_t lanes_max(lanes_t a, lanes_t b)         { return _mm512_max_ps(a, b); }
+inline lanes_t lanes_abs(lanes_t a)                    { return _mm512_abs_ps(a); }
+// Where a < b, take x; elsewhere, take y
+inline lanes_t lanes_select_less(lanes_t a, lanes_t b, lanes_t x, lanes_t y) {
+	return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), y, x);
+}
+#elif defined(__AVX2__)
+typedef __m256 lanes_t;
+inline lanes_t lanes_load(const float32* p)            { return _mm256_load_ps(p); }
+inline void    lanes_store(float32* p, lanes_t a)      { _mm256_store_ps(p, a); }
+inline lanes_t lanes_set(float32 a)                    { return _mm256_set1_ps(a); }
+inline lanes_t lanes_add(lanes_t a, lanes_t b)         { return _mm256_add_ps(a, b); }
+inline lanes_t lanes_sub(lanes_t a, lanes_t b)         { return _mm256_sub_ps(a, b); }
+inline lanes_t lanes_mul(lanes_t a, lanes_t b)         { return _mm256_mul_ps(a, b); }
+inline lanes_t lanes_fmadd(lanes_t a, lanes_t b, lanes_t c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+inline lanes_t lanes_max(lanes_t a, lanes_t b)         { return _mm256_max_ps(a, b); }
+inline lanes_t lanes_abs(lanes_t a)                    { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+inline lanes_t lanes_select_less(lanes_t a, lanes_t b, lanes_t x, lanes_t y) {
+	return _mm256_blendv_ps(y, x, _mm256_cmp_ps(a, b, _CMP_LT_OQ));
+}
+#else
+struct lanes_t { float32 v [AD_BATCH_LANES]; };
+#define lanes_for(i) for (uint32 i = 0; i < AD_BATCH_LANES; i++)
+inline lanes_t lanes_load(const float32* p)            { lanes_t r; lanes_for(i) r.v[i] = p[i]; return r; }
+inline void    lanes_store(float32* p, lanes_t a)      { lanes_for(i) p[i] = a.v[i]; }
+inline lanes_t lanes_set(float32 a)                    { lanes_t r; lanes_for(i) r.v[i] = a; return r; }
+inline lanes_t lanes_add(lanes_t a, lanes_t b)         { lanes_for(i) a.v[i] += b.v[i]; return a; }
+inline lanes_t lanes_sub(lanes_t a, lanes_t b)         { lanes_for(i) a.v[i] -= b.v[i]; return a; }
+inline lanes_t lanes_mul(lanes_t a, lanes_t b)         { lanes_for(i) a.v[i] *= b.v[i]; return a; }
+inline lanes_t lanes_fmadd(lanes_t a, lanes_t b, lanes_t c) { lanes_for(i) c.v[i] += a.v[i] * b.v[i]; return c; }
+inline lanes_t lanes_max(lanes_t a, lanes_t b)         { lanes_for(i) a.v[i] = fmaxf(a.v[i], b.v[i]); return a; }
+inline lanes_t lanes_abs(lanes_t a)                    { lanes_for(i) a.v[i] = fabsf(a.v[i]); return a; }
+inline lanes_t lanes_select_less(lanes_t a, lanes_t b, lanes_t x, lanes_t y) {
+	lanes_for(i) y.v[i] = a.v[i] < b.v[i] ? x.v[i] : y.v[i];
+	return y;
+}
+#endif
+
+// The manifest has one model per line: the featurized file to train on, then where to write the model.
+// Blank lines and lines starting with # are skipped.
+ad_return_t batch_load_manifest(const char* path, std::vector<batch_model_t>* models) {
+	FILE* file = fopen(path, "r");
+	if (!file) return AD_RETURN_BAD_FILE;
+
+	char line [2 * AD_PATH_SIZE + 2];
+	while (fgets(line, sizeof(line), file)) {
+		batch_model_t model;
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%255s %255s", model.input_path, model.output_path) != 2) continue;
+
+		FILE* input = fopen(model.input_path, "rb");
+		bool valid = input && fread(&model.header, sizeof(ad_featurized_header), 1, input) == 1;
+		if (valid) {
+			fseek(input, 0, SEEK_END);
+			valid = featurized_valid(&model.header, ftell(input), model.input_path);
+		}
+		if (input) fclose(input);
+		if (!valid || model.header.layout != ad_featurized_layout::ad_dense) {
+			fprintf(stderr, "skipping model, cannot read a dense featurized file at path = %s\n", model.input_path);
+			continue;
+		}
+		models->push_back(model);
+	}
+
+	fclose(file);
+	return AD_RETURN_SUCCESS;
+}
+
+// Group models with the same number of features, with similar row counts side by side so that few lanes sit
+// idle waiting for the longest model in their group
+void batch_group(std::vector<batch_model_t>* models, std::vector<batch_group_t>* groups) {
+	std::vector<uint32> order(models->size());
+	for (uint32 i = 0; i < order.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&](uint32 a, uint32 b) {
+		ad_featurized_header& ha = (*models)[a].header;
+		ad_featurized_header& hb = (*models)[b].header;
+		if (ha.features_per_row != hb.features_per_row) return ha.features_per_row < hb.features_per_row;
+		return ha.rows < hb.rows;
+	});
+
+	for (uint32 index : order) {
+		ad_featurized_header& header = (*models)[index].header;
+		if (groups->empty() || groups->back().count == AD_BATCH_LANES || groups->back().cols != (uint32)header.features_per_row) {
+			groups->push_back(batch_group_t());
+			groups->back().cols = header.features_per_row;
+		}
+
+		batch_group_t& group = groups->back();
+		group.models[group.count++] = index;
+		group.rows = std::max(group.rows, (uint32)header.rows);
+	}
+}
+
+// Load and normalize each model's rows into the interleaved input buffer. Rows past the end of a model's
+// data stay zero, and are masked off during training. A file that can't be read in full fails the group,
+// since the file may have changed since the manifest was checked.
+bool batch_load_inputs(batch_group_t* group, batch_model_t* models, float32* inputs) {
+	constexpr uint32 L = AD_BATCH_LANES;
+	uint32 cols = group->cols;
+
+	vector_t row;
+	vec_init(&row, cols);
+	bool valid = true;
+	for (uint32 lane = 0; valid && lane < group->count; lane++) {
+		batch_model_t* model = &models[group->models[lane]];
+		FILE* file = fopen(model->input_path, "rb");
+		valid = file && fseek(file, sizeof(ad_featurized_header), SEEK_SET) == 0;
+
+		for (uint32 r = 0; valid && r < (uint32)model->header.rows; r++) {
+			valid = fread(row.data, sizeof(float32), cols, file) == cols;
+			vec_normalize(row);
+			for (uint32 d = 0; d < cols; d++) inputs[(r * cols + d) * L + lane] = row[d];
+		}
+		if (file) fclose(file);
+		if (!valid) fprintf(stderr, "cannot read rows, path = %s\n", model->input_path);
+	}
+	vec_free(row);
+	return valid;
+}
+
+// ad_batch trains line maps with the linear neighborhood and l2sq, from random weights, visiting rows in file
+// order at full precision. Settings asking for a different kind of model are refused. Settings that only
+// change how ad_train would get there are cleared, so the config saved with each model says how it was
+// actually trained (model_warm_start and som_init both read it back).
+#define AD_BATCH_CLEAR(field) \
+	if (memcmp(&config->field, &defaults.field, sizeof(config->field))) { \
+		fprintf(stderr, "batched training ignores %s\n", #field); \
+		memcpy(&config->field, &defaults.field, sizeof(config->field)); \
+	}
+
+bool batch_check_config(config_t* config) {
+	bool valid = true;
+	if (strlen(config->engine) && strcmp(config->engine, "som")) {
+		fprintf(stderr, "batched training only trains maps, not engine = %s\n", config->engine);
+		valid = false;
+	}
+	if (strlen(config->neighborhood_function) && strcmp(config->neighborhood_function, "linear")) {
+		fprintf(stderr, "batched training only uses neighborhood_function = linear, not %s\n", config->neighborhood_function);
+		valid = false;
+	}
+	if (strlen(config->reduction)) {
+		fprintf(stderr, "batched training cannot reduce inputs, reduction = %s\n", config->reduction);
+		valid = false;
+	}
+	if (strlen(config->metric) && strcmp(config->metric, "l2sq")) {
+		fprintf(stderr, "batched training always uses metric = l2sq, ignoring metric = %s\n", config->metric);
+		memset(config->metric, 0, sizeof(config->metric));
+	}
+
+	config_t defaults;
+	AD_BATCH_CLEAR(feature_weights);
+	AD_BATCH_CLEAR(input_precision);
+	AD_BATCH_CLEAR(weight_layout);
+	AD_BATCH_CLEAR(input_ordering);
+	AD_BATCH_CLEAR(warm_learning_rate);
+	AD_BATCH_CLEAR(warm_radius);
+	AD_BATCH_CLEAR(warm_decay_rate);
+	AD_BATCH_CLEAR(checkpoint_file);
+	AD_BATCH_CLEAR(checkpoint_interval);
+	AD_BATCH_CLEAR(threads);
+	AD_BATCH_CLEAR(compact);
+	AD_BATCH_CLEAR(merge_distance);
+	AD_BATCH_CLEAR(batch_size);
+	AD_BATCH_CLEAR(reduced_dimensions);
+	return valid;
+}
+
+// Copy one lane out into a SOM, with the winners and distances from its last epoch, so that it can be saved
+// like any other model
+void batch_unpack(config_t* config, batch_group_t* group, uint32 lane, uint32 rows, float32* weights, float32* winners, float32* distances, som_t* som) {
+	constexpr uint32 L = AD_BATCH_LANES;
+	uint32 clusters = config->count_clusters;
+	uint32 cols = group->cols;
+
+	som->config = *config;
+	mtx_init(&som->weights, clusters, cols);
+	vec_init(&som->winners, rows);
+	vec_init(&som->distances, rows);
+	arr_init(&som->cluster_stats, clusters, cluster_stats_t());
+
+	for (uint32 k = 0; k < clusters; k++) {
+		for (uint32 d = 0; d < cols; d++) *mtx_at(som->weights, k, d) = weights[(k * cols + d) * L + lane];
+	}
+	for (uint32 r = 0; r < rows; r++) {
+		uint32 winner = (uint32)winners[r * L + lane];
+		som->winners[r] = winner;
+		som->distances[r] = distances[r * L + lane];
+		cluster_stats_add(som->cluster_stats[winner], sqrt(distances[r * L + lane]));
+	}
+}
+
+ad_return_t batch_train_group(config_t* config, batch_group_t* group, batch_model_t* models) {
+	constexpr uint32 L = AD_BATCH_LANES;
+	uint32 clusters = config->count_clusters;
+	uint32 cols = group->cols;
+	uint32 rows = group->rows;
+	uint32 weight_size = clusters * cols * L;
+
+	float32* inputs    = (float32*)ad_aligned_alloc(sizeof(float32) * rows * cols * L, 64);
+	float32* weights   = (float32*)ad_aligned_alloc(sizeof(float32) * weight_size, 64);
+	float32* deltas    = (float32*)ad_aligned_alloc(sizeof(float32) * weight_size, 64);
+	float32* distances = (float32*)ad_aligned_alloc(sizeof(float32) * rows * L, 64);
+	float32* winners   = (float32*)ad_aligned_alloc(sizeof(float32) * rows * L, 64);
+	auto free_buffers = [&]() {
+		ad_aligned_free(inputs);
+		ad_aligned_free(weights);
+		ad_aligned_free(deltas);
+		ad_aligned_free(distances);
+		ad_aligned_free(winners);
+	};
+	if (!batch_load_inputs(group, models, inputs)) {
+		free_buffers();
+		return AD_RETURN_BAD_FILE;
+	}
+
+	// Initialize each lane's weights the way som_init would, so a lane starts where ad_train would
+	uint32 lane_rows [L] = { 0 };
+	bool active [L] = { false };
+	float32 last_error [L];
+	for (uint32 lane = 0; lane < group->count; lane++) {
+		lane_rows[lane] = models[group->models[lane]].header.rows;
+		active[lane] = true;
+		last_error[lane] = FLT_MAX;
+
+		rng_t rng;
+		rng_seed(&rng, config->seed);
+		vector_t weight;
+		vec_init(&weight, cols);
+		for (uint32 k = 0; k < clusters; k++) {
+			vec_for(weight, w) *w = rng_float32(&rng);
+			vec_normalize(weight);
+			for (uint32 d = 0; d < cols; d++) weights[(k * cols + d) * L + lane] = weight[d];
+		}
+		vec_free(weight);
+	}
+
+	lanes_t inverse_radius = lanes_set(1.f / som_neighborhood_radius(config));
+	uint32 iteration = 0;
+	while (std::any_of(active, active + L, [](bool a) { return a; })) {
+		iteration++;
+		float32 learning_rate = fmax(config->learning_rate * (1 - iteration / config->decay_rate), 0);
+
+		alignas(64) float32 lane_rate [L];
+		for (uint32 lane = 0; lane < L; lane++) lane_rate[lane] = active[lane] ? learning_rate : 0;
+		lanes_t rate = lanes_load(lane_rate);
+		lanes_t error = lanes_set(0);
+
+		for (uint32 r = 0; r < rows; r++) {
+			float32* x = inputs + r * cols * L;
+			alignas(64) float32 lane_mask [L];
+			for (uint32 lane = 0; lane < L; lane++) lane_mask[lane] = r < lane_rows[lane];
+			lanes_t mask = lanes_load(lane_mask);
+
+			// Find each lane's winner. Winners are kept as floats so that they can be blended like distances.
+			lanes_t best = lanes_set(FLT_MAX);
+			lanes_t winner = lanes_set(0);
+			for (uint32 k = 0; k < clusters; k++) {
+				float32* w = weights + k * cols * L;
+				lanes_t distance = lanes_set(0);
+				for (uint32 d = 0; d < cols; d++) {
+					lanes_t difference = lanes_sub(lanes_load(x + d * L), lanes_load(w + d * L));
+					distance = lanes_fmadd(difference, difference, distance);
+				}
+				winner = lanes_select_less(distance, best, lanes_set((float32)k), winner);
+				best = lanes_select_less(distance, best, distance, best);
+			}
+
+			error = lanes_fmadd(best, mask, error);
+			lanes_store(winners + r * L, winner);
+			lanes_store(distances + r * L, best);
+
+			// Accumulate deltas with the same linear neighborhood as ns_linear: 1 - |k - winner| / radius
+			lanes_t step = lanes_mul(rate, mask);
+			for (uint32 k = 0; k < clusters; k++) {
+				lanes_t distance = lanes_abs(lanes_sub(lanes_set((float32)k), winner));
+				lanes_t strength = lanes_max(lanes_sub(lanes_set(1), lanes_mul(distance, inverse_radius)), lanes_set(0));
+				lanes_t k_rate = lanes_mul(step, strength);
+
+				float32* w = weights + k * cols * L;
+				float32* delta = deltas + k * cols * L;
+				for (uint32 d = 0; d < cols; d++) {
+					lanes_t difference = lanes_sub(lanes_load(x + d * L), lanes_load(w + d * L));
+					lanes_store(delta + d * L, lanes_fmadd(k_rate, difference, lanes_load(delta + d * L)));
+				}
+			}
+		}
+
+		// Same scaling as apply_deltas. Masked lanes accumulated nothing, so they don't move.
+		float32 scale = 1.f / (clusters * cols);
+		for (uint32 i = 0; i < weight_size; i++) {
+			weights[i] += deltas[i] * scale;
+			deltas[i] = 0;
+		}
+
+		alignas(64) float32 lane_error [L];
+		lanes_store(lane_error, error);
+		for (uint32 lane = 0; lane < group->count; lane++) {
+			if (!active[lane]) continue;
+			if (fabs(lane_error[lane] - last_error[lane]) < config->error_threshold) {
+				active[lane] = false;
+				models[group->models[lane]].iterations = iteration;
+			}
+			last_error[lane] = lane_error[lane];
+		}
+	}
+
+	ad_return_t result = AD_RETURN_SUCCESS;
+	for (uint32 lane = 0; lane < group->count; lane++) {
+		batch_model_t* model = &models[group->models[lane]];
+		model->error = last_error[lane];
+
+		som_t som;
+		batch_unpack(config, group, lane, lane_rows[lane], weights, winners, distances, &som);
+		if (model_save(&som, model->output_path)) {
+			fprintf(stderr, "cannot write model, path = %s\n", model->output_path);
+			result = AD_RETURN_BAD_FILE;
+		}
+		free(som.weights.data);
+		vec_free(som.winners);
+		vec_free(som.distances);
+		arr_free(&som.cluster_stats);
+	}
+
+	free_buffers();
+	return result;
+}
+
+const char* help =
+	"ad_batch: train many small models at once, several per vector register\n\n"
+
+	"usage:\n"
+	"  -c [config_path]: required, path to a config file shared by every model\n"
+	"  -m [manifest_path]: required, one model per line: a featurized file, then where to write the model\n"
+	"  -t [threads]: training threads, default one per hardware thread";
+
+int main(int arg_count, char** args) {
+	char config_path   [AD_PATH_SIZE] = { 0 };
+	char manifest_path [AD_PATH_SIZE] = { 0 };
+	uint32 threads = 0;
+
+	for (int32 i = 1; i < arg_count; i++) {
+		char* flag = args[i];
+		if (!strcmp(flag, AD_FLAG_CONFIG)) {
+			strncpy(config_path, args[++i], AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_MANIFEST)) {
+			strncpy(manifest_path, args[++i], AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_THREADS)) {
+			threads = atoi(args[++i]);
+		}
+		else if (!strcmp(flag, AD_FLAG_HELP)) {
+			printf("%s\n", help);
+			exit(0);
+		}
+	}
+
+	if (!strlen(config_path) || !strlen(manifest_path)) {
+		printf("%s\n", help);
+		exit(1);
+	}
+
+	init_paths();
+
+	config_t config;
+	cfg_load(&config, config_path);
+	if (!batch_check_config(&config)) exit(1);
+
+	std::vector<batch_model_t> models;
+	if (batch_load_manifest(manifest_path, &models)) {
+		fprintf(stderr, "cannot open manifest, path = %s\n", manifest_path);
+		exit(1);
+	}
+
+	std::vector<batch_group_t> groups;
+	batch_group(&models, &groups);
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<ad_return_t> results(groups.size());
+	ad_parallel_for(groups.size(), threads, [&](uint32 begin, uint32 end, uint32) {
+		for (uint32 i = begin; i < end; i++) results[i] = batch_train_group(&config, &groups[i], models.data());
+	});
+	float64 seconds = std::chrono::duration<float64>(std::chrono::steady_clock::now() - start).count();
+
+	if (!config.quiet) {
+		for (batch_model_t& model : models) {
+			printf("%s: iterations = %d, error = %f\n", model.output_path, model.iterations, model.error);
+		}
+	}
+	printf("trained %d models in %d groups of up to %d in %.3f ms\n", (int32)models.size(), (int32)groups.size(), AD_BATCH_LANES, seconds * 1000);
+
+	uint32 failed = std::count_if(results.begin(), results.end(), [](ad_return_t result) { return result != AD_RETURN_SUCCESS; });
+	if (failed) {
+		fprintf(stderr, "%d of %d groups failed, and some models were not written\n", failed, (int32)groups.size());
+		return 1;
+	}
+	return 0;
+}
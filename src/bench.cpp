@@ -0,0 +1,400 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "types.hpp"
+#include "pack.hpp"
+#include "math.hpp"
+#include "som.hpp"
+#include "codebook.hpp"
+#include "online.hpp"
+#include "pq.hpp"
+#include "platform.hpp"
+
+#define AD_FLAG_CONFIG "-c"
+#define AD_FLAG_MODE "-m"
+#define AD_FLAG_EPOCHS "-e"
+#define AD_FLAG_REPEAT "-x"
+#define AD_FLAG_HELP "-h"
+
+struct bench_dataset_t {
+	ad_featurized_header header;
+	std::vector<float32> data;
+};
+
+struct bench_options_t {
+	uint32 epochs = 50;
+	uint32 repeat = 1;
+};
+
+typedef void (*bench_fn)(config_t*, bench_dataset_t*, bench_options_t*);
+
+
+// Utilities
+float64 bench_now() {
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration<float64, std::milli>(now).count();
+}
+
+// Load a dense featurized dataset, tiled repeat times so that small datasets can stand in for large ones
+void load_dataset(config_t* config, uint32 repeat, bench_dataset_t* dataset) {
+	char path [AD_PATH_SIZE];
+	paths::ad_data(config->featurized_data_file, path, AD_PATH_SIZE);
+
+	FILE* file = fopen(path, "r");
+	if (!file) { fprintf(stderr, "cannot open input file, path = %s\n", path); exit(1); }
+	fseek(file, 0, SEEK_END);
+	uint64 file_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	bool valid = fread(&dataset->header, sizeof(ad_featurized_header), 1, file) == 1;
+	if (!valid || !featurized_valid(&dataset->header, file_size, path)) exit(1);
+	if (dataset->header.layout != ad_featurized_layout::ad_dense) {
+		fprintf(stderr, "benchmarks need a dense dataset, path = %s\n", path);
+		exit(1);
+	}
+
+	uint32 size = dataset->header.rows * dataset->header.features_per_row;
+	dataset->data.resize(size * repeat);
+	fread(dataset->data.data(), sizeof(float32), size, file);
+	fclose(file);
+
+	for (uint32 i = 1; i < repeat; i++) {
+		memcpy(dataset->data.data() + i * size, dataset->data.data(), size * sizeof(float32));
+	}
+	dataset->header.rows *= repeat;
+}
+
+// Train a fresh SOM on a copy of the dataset for a fixed number of epochs. Returns milliseconds per epoch;
+// the trained SOM is left in som so callers can measure its quality.
+float64 bench_train(som_t* som, bench_dataset_t* dataset, std::vector<float32>* copy, uint32 epochs) {
+	*copy = dataset->data;
+	som_init(som, copy->data(), dataset->header.rows, dataset->header.features_per_row);
+
+	float64 start = bench_now();
+	for (uint32 i = 0; i < epochs; i++) {
+		som_iterate(som);
+		apply_deltas(som);
+	}
+	return (bench_now() - start) / epochs;
+}
+
+
+// Benchmarks
+void bench_precision(config_t* config, bench_dataset_t* dataset, bench_options_t* options) {
+	const char* precisions [] = { "fp32", "fp16", "bf16" };
+
+	float64 baseline_time = 0;
+	float32 baseline_error = 0;
+	for (const char* precision : precisions) {
+		som_t som;
+		som.config = *config;
+		strncpy(som.config.input_precision, precision, sizeof(som.config.input_precision) - 1);
+
+		std::vector<float32> copy;
+		float64 time = bench_train(&som, dataset, &copy, options->epochs);
+		float32 error = som_error(&som) / dataset->header.rows;
+
+		if (!baseline_time) {
+			baseline_time = time;
+			baseline_error = error;
+		}
+		printf("%s: %.3f ms/epoch (%.2fx), quantization error = %f (%+.3e)\n",
+			   precision, time, baseline_time / time, error, error - baseline_error);
+	}
+}
+
+void bench_ordering(config_t* config, bench_dataset_t* dataset, bench_options_t* options) {
+	const char* orderings [] = { "indirect", "gather", "block" };
+
+	float64 baseline_time = 0;
+	float32 baseline_error = 0;
+	for (const char* ordering : orderings) {
+		som_t som;
+		som.config = *config;
+		strncpy(som.config.input_ordering, ordering, sizeof(som.config.input_ordering) - 1);
+
+		std::vector<float32> copy;
+		float64 time = bench_train(&som, dataset, &copy, options->epochs);
+		float32 error = som_error(&som) / dataset->header.rows;
+
+		if (!baseline_time) {
+			baseline_time = time;
+			baseline_error = error;
+		}
+		printf("%s: %.3f ms/epoch (%.2fx), quantization error = %f (%+.3e)\n",
+			   ordering, time, baseline_time / time, error, error - baseline_error);
+	}
+}
+
+void bench_quantized(config_t* config, bench_dataset_t* dataset, bench_options_t* options) {
+	som_t som;
+	som.config = *config;
+	std::vector<float32> copy;
+	bench_train(&som, dataset, &copy, options->epochs);
+
+	std::vector<uint32> winners(som.inputs.rows);
+	float64 start = bench_now();
+	mtx_for(som.inputs, input) {
+		winners[mtx_indexof(som.inputs, input)] = find_winning_cluster(&som, input);
+	}
+	float64 baseline_time = bench_now() - start;
+	uint32 baseline_bytes = mtx_size(som.weights) * sizeof(float32);
+	printf("float32: %.3f ms, %u bytes\n", baseline_time, baseline_bytes);
+
+	struct { bool per_feature; uint32 rerank; const char* name; } runs [] = {
+		{ false, 0, "int8 per row" },
+		{ false, 4, "int8 per row, rerank 4" },
+		{ true,  0, "int8 per feature" },
+		{ true,  4, "int8 per feature, rerank 4" },
+	};
+	for (auto& run : runs) {
+		codebook_t codebook;
+		cb_init(&codebook, som.weights, run.per_feature);
+		codebook_query_t query;
+		cb_query_init(&codebook, &query);
+
+		uint32 matches = 0;
+		float32 distance;
+		start = bench_now();
+		mtx_for(som.inputs, input) {
+			cb_query_load(&codebook, input, &query);
+			uint32 winner = cb_find_winning_cluster(&codebook, &query, som.weights, input, run.rerank, &distance);
+			matches += winner == winners[mtx_indexof(som.inputs, input)];
+		}
+		float64 time = bench_now() - start;
+
+		printf("%s: %.3f ms (%.2fx), %u bytes, exact winners = %.2f%%\n",
+			   run.name, time, baseline_time / time, cb_bytes(&codebook), 100.f * matches / som.inputs.rows);
+
+		cb_query_free(&query);
+		cb_free(&codebook);
+	}
+}
+
+// Threshold checks against full scoring, at a threshold that flags the worst 1% of rows, so most rows are normal
+void bench_threshold(config_t* config, bench_dataset_t* dataset, bench_options_t* options) {
+	som_t som;
+	som.config = *config;
+	std::vector<float32> copy;
+	bench_train(&som, dataset, &copy, options->epochs);
+
+	uint32 rows = som.inputs.rows;
+	std::vector<uint32> winners(rows);
+	std::vector<float32> scores(rows);
+	float64 start = bench_now();
+	som_predict(&som, som.inputs, winners.data(), scores.data(), 1);
+	float64 baseline_time = bench_now() - start;
+
+	std::vector<float32> sorted = scores;
+	std::nth_element(sorted.begin(), sorted.begin() + rows * 99 / 100, sorted.end());
+	float32 threshold = sorted[rows * 99 / 100];
+	printf("full scoring: %.3f ms, threshold = %f\n", baseline_time, threshold);
+
+	std::vector<uint32> hits(som.weights.rows);
+	for (uint32 winner : winners) hits[winner]++;
+
+	std::vector<uint8> flags(rows);
+	for (bool population : { false, true }) {
+		if (population) som_probe_order(&som, hits.data());
+
+		start = bench_now();
+		som_flag_anomalies(&som, som.inputs, threshold, flags.data(), 1);
+		float64 time = bench_now() - start;
+
+		uint32 flagged = 0;
+		uint32 disagreements = 0;
+		for (uint32 i = 0; i < rows; i++) {
+			flagged += flags[i];
+			disagreements += flags[i] != (scores[i] > threshold);
+		}
+		printf("%s: %.3f ms (%.2fx), flagged = %u, disagreements = %u\n",
+			   population ? "population order" : "index order", time, baseline_time / time, flagged, disagreements);
+	}
+}
+
+// Stream the dataset through an online trainer while scoring threads score it in chunks against whichever map
+// is current, and compare their throughput with scoring against a fixed map
+void bench_online(config_t* config, bench_dataset_t* dataset, bench_options_t* options) {
+	const uint32 chunk = 256;
+	const uint32 count_readers = 2;
+	uint32 rows = dataset->header.rows;
+	uint32 cols = dataset->header.features_per_row;
+
+	online_trainer_t trainer;
+	online_start(&trainer, config, cols);
+	printf("window = %d rows, retrain every %d rows\n", trainer.config.window_rows,
+		   trainer.config.retrain_interval ? trainer.config.retrain_interval : trainer.config.window_rows);
+
+	std::atomic<bool> done { false };
+	std::atomic<uint64> scored { 0 };
+	std::atomic<uint32> swaps { 0 };
+	std::vector<std::thread> readers;
+	for (uint32 i = 0; i < count_readers; i++) {
+		readers.emplace_back([&, i]() {
+			uint32 reader = online_reader(&trainer);
+			std::vector<uint32> winners(chunk);
+			std::vector<float32> scores(chunk);
+			uint64 last_version = 0;
+			for (uint32 begin = i * chunk; !done; begin = (begin + count_readers * chunk) % rows) {
+				matrix_t block;
+				mtx_init(&block, dataset->data.data() + begin * cols, rows - begin < chunk ? rows - begin : chunk, cols);
+				uint64 version = online_predict(&trainer, reader, block, winners.data(), scores.data());
+				if (!version) { std::this_thread::yield(); continue; }
+
+				scored += block.rows;
+				if (version != last_version) swaps++;
+				last_version = version;
+			}
+		});
+	}
+
+	// Keep streaming the dataset until a few maps have been published. The pushing thread is a reader too,
+	// since it looks at the current map's version.
+	const uint64 count_maps = 4;
+	uint32 pusher = online_reader(&trainer);
+	uint64 version = 0;
+	float64 start = bench_now();
+	for (uint32 begin = 0; version < count_maps; begin = (begin + chunk) % rows) {
+		online_push(&trainer, dataset->data.data() + begin * cols, rows - begin < chunk ? rows - begin : chunk);
+		std::this_thread::yield();
+
+		online_model_t* model = online_acquire(&trainer, pusher);
+		version = model ? model->version : 0;
+		online_release(&trainer, pusher);
+	}
+	float64 time = bench_now() - start;
+	done = true;
+	for (auto& reader : readers) reader.join();
+	online_stop(&trainer);
+	printf("online: %.3f ms, %d maps published, %d swaps seen by readers, %.2f million rows/s scored\n",
+		   time, (uint32)version, (uint32)swaps, scored / time / 1e3);
+
+	// The same scoring against a map that never changes
+	som_t som;
+	som.config = *config;
+	std::vector<float32> copy;
+	bench_train(&som, dataset, &copy, options->epochs);
+
+	std::vector<uint32> winners(rows);
+	std::vector<float32> scores(rows);
+	matrix_t all;
+	mtx_init(&all, dataset->data.data(), rows, cols);
+	start = bench_now();
+	som_predict(&som, all, winners.data(), scores.data(), 1);
+	time = bench_now() - start;
+	printf("fixed map: %.2f million rows/s scored\n", rows / time / 1e3);
+	som_free(&som);
+}
+
+// Scoring through product quantization indexes of a few sizes against exact scoring. Recall is the share of
+// rows whose winner matches the exact one.
+void bench_pq(config_t* config, bench_dataset_t* dataset, bench_options_t* options) {
+	som_t som;
+	som.config = *config;
+	std::vector<float32> copy;
+	bench_train(&som, dataset, &copy, options->epochs);
+
+	uint32 rows = som.inputs.rows;
+	std::vector<uint32> exact(rows);
+	std::vector<uint32> winners(rows);
+	std::vector<float32> scores(rows);
+	float64 start = bench_now();
+	som_predict(&som, som.inputs, exact.data(), scores.data(), 1);
+	float64 baseline_time = bench_now() - start;
+	printf("exact: %.3f ms, %llu bytes\n", baseline_time, (unsigned long long)mtx_size(som.weights) * sizeof(float32));
+
+	const uint32 subspaces [] = { 8, 16, 32, 64 };
+	const uint32 shortlists [] = { 4, 16, 64 };
+	for (uint32 count_subspaces : subspaces) {
+		if (count_subspaces > som.weights.cols) continue;
+
+		start = bench_now();
+		som_pq_init(&som, count_subspaces, 0, som.config.seed);
+		printf("%d subspaces of %d features: built in %.3f ms, %llu bytes\n", som.pq->subspaces, som.pq->width,
+			   bench_now() - start, (unsigned long long)pq_bytes(som.pq));
+
+		for (uint32 shortlist : shortlists) {
+			som.pq->shortlist = shortlist;
+			start = bench_now();
+			som_predict(&som, som.inputs, winners.data(), scores.data(), 1);
+			float64 time = bench_now() - start;
+
+			uint32 matches = 0;
+			for (uint32 i = 0; i < rows; i++) matches += winners[i] == exact[i];
+			printf("  shortlist %d: %.3f ms (%.2fx), recall = %.2f%%\n", shortlist, time, baseline_time / time, 100.f * matches / rows);
+		}
+		som_pq_free(&som);
+	}
+	som_free(&som);
+}
+
+bench_fn get_bench(const char* name) {
+	if (!strcmp(name, "precision")) return &bench_precision;
+	if (!strcmp(name, "quantized")) return &bench_quantized;
+	if (!strcmp(name, "ordering"))  return &bench_ordering;
+	if (!strcmp(name, "threshold")) return &bench_threshold;
+	if (!strcmp(name, "online"))    return &bench_online;
+	if (!strcmp(name, "pq"))        return &bench_pq;
+
+	return nullptr;
+}
+
+
+// CLI
+const char* help =
+	"ad_bench: benchmark training and scoring kernels on a featurized dataset\n\n"
+
+	"usage:\n"
+	"  -c [config_path]: required, path to a config file\n"
+	"  -m [mode] {precision, quantized, ordering, threshold, online, pq}: required, which benchmark to run\n"
+	"  -e [epochs]: training epochs per run, default 50\n"
+	"  -x [repeat]: tile the dataset this many times, default 1";
+
+int main(int arg_count, char** args) {
+	char config_path [AD_PATH_SIZE] = { 0 };
+	char mode [64] = { 0 };
+	bench_options_t options;
+
+	for (int32 i = 1; i < arg_count; i++) {
+		char* flag = args[i];
+		if (!strcmp(flag, AD_FLAG_CONFIG)) {
+			strncpy(config_path, args[++i], AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_MODE)) {
+			strncpy(mode, args[++i], 63);
+		}
+		else if (!strcmp(flag, AD_FLAG_EPOCHS)) {
+			options.epochs = atoi(args[++i]);
+		}
+		else if (!strcmp(flag, AD_FLAG_REPEAT)) {
+			options.repeat = atoi(args[++i]);
+		}
+		else if (!strcmp(flag, AD_FLAG_HELP)) {
+			printf("%s\n", help);
+			exit(0);
+		}
+	}
+
+	bench_fn bench = get_bench(mode);
+	if (!strlen(config_path) || !bench || !options.epochs || !options.repeat) {
+		printf("%s\n", help);
+		exit(1);
+	}
+
+	init_paths();
+
+	config_t config;
+	cfg_load(&config, config_path);
+
+	bench_dataset_t dataset;
+	load_dataset(&config, options.repeat, &dataset);
+	printf("rows = %d, features per row = %d, epochs = %d\n", dataset.header.rows, dataset.header.features_per_row, options.epochs);
+
+	bench(&config, &dataset, &options);
+	return 0;
+}
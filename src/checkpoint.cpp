@@ -0,0 +1,165 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "checkpoint.hpp"
+#include "platform.hpp"
+#include "utils.hpp"
+
+uint32 ad_checkpoint_header::magic   = 0x4B434441; // ADCK
+uint32 ad_checkpoint_header::version = 3;
+
+void ckpt_writer_init(checkpoint_writer_t* writer, const char* path) {
+	strncpy(writer->path, path, AD_PATH_SIZE - 1);
+}
+
+void ckpt_write(checkpoint_writer_t* writer) {
+	char temporary_path [AD_PATH_SIZE + 8];
+	snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", writer->path);
+
+	FILE* file = fopen(temporary_path, "wb");
+	if (!file) {
+		fprintf(stderr, "cannot open checkpoint file, path = %s\n", temporary_path);
+		writer->busy = false;
+		return;
+	}
+
+	bool written = fwrite(writer->snapshot.data(), writer->snapshot.size(), 1, file) == 1;
+	written &= fclose(file) == 0;
+	if (!written || !ad_replace_file(temporary_path, writer->path)) {
+		fprintf(stderr, "failed to write checkpoint, path = %s\n", writer->path);
+	}
+
+	writer->busy = false;
+}
+
+bool ckpt_save(checkpoint_writer_t* writer, som_t* som, float32 last_error) {
+	if (writer->busy) return false;
+	if (writer->thread.joinable()) writer->thread.join();
+
+	uint64 weight_bytes = mtx_size(som->weights) * sizeof(float32);
+	uint64 order_bytes = som->input_order.size * sizeof(uint32);
+	uint64 count_bytes = som->unit_counts.size * sizeof(uint32);
+	uint64 projection_bytes = som->projection ? proj_bytes(som->projection) : 0;
+	uint64 body_bytes = weight_bytes + order_bytes + count_bytes + projection_bytes;
+	writer->snapshot.resize(sizeof(ad_checkpoint_header) + body_bytes);
+
+	char* weights = writer->snapshot.data() + sizeof(ad_checkpoint_header);
+	char* order = weights + weight_bytes;
+	char* counts = order + order_bytes;
+	char* projection = counts + count_bytes;
+	memcpy(weights, som->weights.data, weight_bytes);
+	memcpy(order, som->input_order.data, order_bytes);
+	memcpy(counts, som->unit_counts.data, count_bytes);
+	if (projection_bytes) memcpy(projection, proj_data(som->projection), projection_bytes);
+
+	ad_checkpoint_header header;
+	header.file_magic = ad_checkpoint_header::magic;
+	header.file_version = ad_checkpoint_header::version;
+	header.rows = som->input_order.size;
+	header.cols = som->weights.cols;
+	header.clusters = som->weights.rows;
+	header.iteration = som->iteration;
+	header.last_error = last_error;
+	header.unit_counts = som->unit_counts.size;
+	if (som->projection) {
+		header.projection = som->projection->kind;
+		header.input_cols = som->projection->input_cols;
+		header.projection_nonzeros = som->projection->nonzeros;
+		header.projection_offset = projection - writer->snapshot.data();
+	}
+	header.rng = som->rng;
+	header.checksum = ad_hash(weights, body_bytes);
+	memcpy(writer->snapshot.data(), &header, sizeof(ad_checkpoint_header));
+
+	writer->busy = true;
+	writer->thread = std::thread(ckpt_write, writer);
+	return true;
+}
+
+void ckpt_writer_wait(checkpoint_writer_t* writer) {
+	if (writer->thread.joinable()) writer->thread.join();
+}
+
+// Restore a checkpoint into a SOM that was already initialized on the same data
+ad_return_t ckpt_load(som_t* som, const char* path, float32* last_error) {
+	FILE* file = fopen(path, "rb");
+	if (!file) return AD_RETURN_BAD_FILE;
+
+	ad_checkpoint_header header;
+	bool valid = fread(&header, sizeof(ad_checkpoint_header), 1, file) == 1;
+	valid &= header.file_magic == ad_checkpoint_header::magic;
+	valid &= header.file_version == ad_checkpoint_header::version;
+	valid &= header.rows == (uint32)som->input_order.capacity;
+	valid &= header.cols == som->weights.cols;
+	valid &= header.clusters == som->weights.rows;
+	valid &= header.unit_counts == (uint32)som->unit_counts.size;
+	valid &= header.projection == (som->projection ? som->projection->kind : projection_kind::none);
+	valid &= !som->projection || header.input_cols == som->projection->input_cols;
+	if (!valid) {
+		fprintf(stderr, "checkpoint does not match this model and dataset, path = %s\n", path);
+		fclose(file);
+		return AD_RETURN_BAD_HEADER;
+	}
+
+	uint64 weight_bytes = mtx_size(som->weights) * sizeof(float32);
+	uint64 order_bytes = header.rows * sizeof(uint32);
+	uint64 count_bytes = header.unit_counts * sizeof(uint32);
+	uint64 projection_bytes = som->projection ? proj_bytes(som->projection) : 0;
+	std::vector<char> data(weight_bytes + order_bytes + count_bytes + projection_bytes);
+	valid = fread(data.data(), data.size(), 1, file) == 1;
+	fclose(file);
+	if (!valid || ad_hash(data.data(), data.size()) != header.checksum) {
+		fprintf(stderr, "checkpoint is truncated or corrupt, path = %s\n", path);
+		return AD_RETURN_BAD_FILE;
+	}
+
+	// The SOM's projection came from this checkpoint (see ckpt_load_projection), unless it was fitted again
+	char* projection = data.data() + weight_bytes + order_bytes + count_bytes;
+	if (projection_bytes && memcmp(projection, proj_data(som->projection), projection_bytes)) {
+		fprintf(stderr, "checkpoint was trained on differently projected inputs, path = %s\n", path);
+		return AD_RETURN_BAD_HEADER;
+	}
+
+	memcpy(som->weights.data, data.data(), weight_bytes);
+	memcpy(som->input_order.data, data.data() + weight_bytes, order_bytes);
+	memcpy(som->unit_counts.data, data.data() + weight_bytes + order_bytes, count_bytes);
+	som->input_order.size = header.rows;
+	som->iteration = header.iteration;
+	som->rng = header.rng;
+	if (som->is_soa) soa_from_mtx(som->soa_weights, som->weights);
+	*last_error = header.last_error;
+
+	return AD_RETURN_SUCCESS;
+}
+
+ad_return_t ckpt_load_projection(projection_t* projection, const char* path) {
+	*projection = projection_t();
+	FILE* file = fopen(path, "rb");
+	if (!file) return AD_RETURN_BAD_FILE;
+
+	ad_checkpoint_header header;
+	bool valid = fread(&header, sizeof(ad_checkpoint_header), 1, file) == 1;
+	valid &= header.file_magic == ad_checkpoint_header::magic;
+	valid &= header.file_version == ad_checkpoint_header::version;
+	if (!valid || header.projection == projection_kind::none) {
+		fclose(file);
+		return valid ? AD_RETURN_SUCCESS : AD_RETURN_BAD_HEADER;
+	}
+
+	// The checksum is checked when the rest of the checkpoint is loaded, and covers these bytes too
+	proj_view(projection, header.projection, header.input_cols, header.cols, header.projection_nonzeros, nullptr);
+	uint64 bytes = proj_bytes(projection);
+	void* data = malloc(bytes);
+	valid = fseek(file, header.projection_offset, SEEK_SET) == 0 && fread(data, bytes, 1, file) == 1;
+	fclose(file);
+	if (!valid) {
+		free(data);
+		*projection = projection_t();
+		return AD_RETURN_BAD_FILE;
+	}
+
+	proj_view(projection, header.projection, header.input_cols, header.cols, header.projection_nonzeros, data);
+	projection->owned = true;
+	return AD_RETURN_SUCCESS;
+}
@@ -0,0 +1,226 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <float.h>
+#include <cassert>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "codebook.hpp"
+#include "kernels.hpp"
+#include "utils.hpp"
+
+int8 quantize(float32 value, float32 scale) {
+	int32 q = (int32)roundf(value / scale);
+	if (q > 127) q = 127;
+	if (q < -127) q = -127;
+	return (int8)q;
+}
+
+void cb_init(codebook_t* cb, matrix_t& weights, bool per_feature) {
+	cb->rows = weights.rows;
+	cb->cols = weights.cols;
+	cb->stride = ad_align(weights.cols, AD_CODEBOOK_ALIGNMENT);
+	cb->per_feature = per_feature;
+
+	uint32 count_scales = per_feature ? cb->cols : cb->rows;
+	cb->data = (int8*)ad_aligned_alloc(cb->rows * cb->stride, AD_CODEBOOK_ALIGNMENT);
+	cb->scales = (float32*)calloc(sizeof(float32), count_scales);
+	cb->norms = (float32*)calloc(sizeof(float32), cb->rows);
+	cb->sums = (int32*)calloc(sizeof(int32), cb->rows);
+
+	// Pick scales so that the largest magnitude in each row (or column) maps to 127
+	for (uint32 row = 0; row < cb->rows; row++) {
+		for (uint32 col = 0; col < cb->cols; col++) {
+			float32* scale = per_feature ? &cb->scales[col] : &cb->scales[row];
+			*scale = fmax(*scale, fabs(*mtx_at(weights, row, col)) / 127.f);
+		}
+	}
+	for (uint32 i = 0; i < count_scales; i++) {
+		if (!cb->scales[i]) cb->scales[i] = 1;
+	}
+
+	for (uint32 row = 0; row < cb->rows; row++) {
+		int8* q = cb->data + row * cb->stride;
+		for (uint32 col = 0; col < cb->cols; col++) {
+			float32 scale = per_feature ? cb->scales[col] : cb->scales[row];
+			q[col] = quantize(*mtx_at(weights, row, col), scale);
+
+			float32 dequantized = q[col] * scale;
+			cb->norms[row] += dequantized * dequantized;
+			cb->sums[row] += q[col];
+		}
+	}
+}
+
+void cb_free(codebook_t* cb) {
+	ad_aligned_free(cb->data);
+	free(cb->scales);
+	free(cb->norms);
+	free(cb->sums);
+	*cb = codebook_t();
+}
+
+uint32 cb_bytes(codebook_t* cb) {
+	uint32 count_scales = cb->per_feature ? cb->cols : cb->rows;
+	return cb->rows * cb->stride + count_scales * sizeof(float32) + cb->rows * (sizeof(float32) + sizeof(int32));
+}
+
+void cb_query_init(codebook_t* cb, codebook_query_t* query) {
+	query->data = (int8*)ad_aligned_alloc(cb->stride, AD_CODEBOOK_ALIGNMENT);
+	query->scale = 1;
+	query->norm = 0;
+}
+
+void cb_query_load(codebook_t* cb, vector_t& input, codebook_query_t* query) {
+	assert(input.size == cb->cols);
+
+	float32 max = 0;
+	query->norm = 0;
+	for (uint32 i = 0; i < input.size; i++) {
+		float32 value = cb->per_feature ? input[i] * cb->scales[i] : input[i];
+		max = fmax(max, fabs(value));
+		query->norm += input[i] * input[i];
+	}
+
+	query->scale = max ? max / 127.f : 1;
+	for (uint32 i = 0; i < input.size; i++) {
+		float32 value = cb->per_feature ? input[i] * cb->scales[i] : input[i];
+		query->data[i] = quantize(value, query->scale);
+	}
+}
+
+void cb_query_free(codebook_query_t* query) {
+	ad_aligned_free(query->data);
+	query->data = nullptr;
+}
+
+// Integer dot product between the query and one row of the codebook
+int32 cb_dot(codebook_t* cb, codebook_query_t* query, uint32 row) {
+	int8* w = cb->data + row * cb->stride;
+	int8* x = query->data;
+
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+	// dpbusd multiplies unsigned by signed bytes. Flipping the query's sign bit adds 128 to each byte,
+	// which adds 128 * sum(w) to the result; that's precomputed per row and taken back out.
+	__m512i bias = _mm512_set1_epi8((char)0x80);
+	__m512i sum = _mm512_setzero_si512();
+	for (uint32 i = 0; i < cb->stride; i += 64) {
+		__m512i vx = _mm512_xor_si512(_mm512_load_si512(x + i), bias);
+		__m512i vw = _mm512_load_si512(w + i);
+		sum = _mm512_dpbusd_epi32(sum, vx, vw);
+	}
+	return _mm512_reduce_add_epi32(sum) - 128 * cb->sums[row];
+#elif defined(__AVX2__)
+	// Widen to 16 bits before multiplying; maddubs would saturate
+	__m256i sum = _mm256_setzero_si256();
+	for (uint32 i = 0; i < cb->stride; i += 16) {
+		__m256i vx = _mm256_cvtepi8_epi16(_mm_load_si128((__m128i*)(x + i)));
+		__m256i vw = _mm256_cvtepi8_epi16(_mm_load_si128((__m128i*)(w + i)));
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(vx, vw));
+	}
+	__m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(half);
+#else
+	int32 sum = 0;
+	for (uint32 i = 0; i < cb->cols; i++) sum += x[i] * w[i];
+	return sum;
+#endif
+}
+
+// The keep best approximate candidates, sorted by distance. Returns how many there are, fewer than keep
+// only if the codebook has fewer rows.
+uint32 cb_shortlist(codebook_t* cb, codebook_query_t* query, uint32 keep, uint32* candidates, float32* distances) {
+	uint32 count = 0;
+	for (uint32 row = 0; row < cb->rows; row++) {
+		float32 scale = cb->per_feature ? query->scale : query->scale * cb->scales[row];
+		float32 d = query->norm - 2 * scale * cb_dot(cb, query, row) + cb->norms[row];
+		if (count == keep && d >= distances[count - 1]) continue;
+
+		uint32 i = count < keep ? count++ : count - 1;
+		for (; i > 0 && distances[i - 1] > d; i--) {
+			candidates[i] = candidates[i - 1];
+			distances[i] = distances[i - 1];
+		}
+		candidates[i] = row;
+		distances[i] = d;
+	}
+	return count;
+}
+
+uint32 cb_find_winning_cluster(codebook_t* cb, codebook_query_t* query, matrix_t& weights, vector_t& input, uint32 rerank, float32* distance) {
+	if (rerank > AD_CODEBOOK_MAX_RERANK) rerank = AD_CODEBOOK_MAX_RERANK;
+
+	uint32  candidates [AD_CODEBOOK_MAX_RERANK] = { 0 };
+	float32 distances  [AD_CODEBOOK_MAX_RERANK];
+	uint32 count = cb_shortlist(cb, query, rerank ? rerank : 1, candidates, distances);
+	if (!count) {
+		*distance = FLT_MAX;
+		return 0;
+	}
+
+	if (!rerank) {
+		*distance = fmax(distances[0], 0);
+		return candidates[0];
+	}
+
+	uint32 winning_cluster = candidates[0];
+	float32 min_distance = FLT_MAX;
+	for (uint32 i = 0; i < count; i++) {
+		vector_t weight = mtx_at(weights, candidates[i]);
+		float32 d = 0;
+		for (uint32 j = 0; j < input.size; j++) d += (input[j] - weight[j]) * (input[j] - weight[j]);
+		if (d < min_distance) {
+			winning_cluster = candidates[i];
+			min_distance = d;
+		}
+	}
+
+	*distance = min_distance;
+	return winning_cluster;
+}
+
+void cb_find_bmu(som_t* som, vector_t& input, bmu_t* bmu) {
+	codebook_t* cb = som->codebook;
+	alignas(AD_CODEBOOK_ALIGNMENT) int8 data [AD_CODEBOOK_MAX_COLS];
+	codebook_query_t query = { data, 1, 0 };
+	cb_query_load(cb, input, &query);
+
+	uint32  candidates [AD_CODEBOOK_MAX_RERANK];
+	float32 distances  [AD_CODEBOOK_MAX_RERANK];
+	uint32 count = cb_shortlist(cb, &query, cb->rerank, candidates, distances);
+
+	float32 second_distance;
+	bmu_init(bmu, &second_distance);
+	for (uint32 i = 0; i < count; i++) {
+		float32* weight = som->weights.data + (uint64)candidates[i] * som->weights.cols;
+		bmu_update(bmu, &second_distance, candidates[i], som->kernels.distance_bounded(som, input.data, weight, second_distance));
+	}
+}
+
+// Maps wider than a stack query are left on the dense kernels
+void som_codebook_init(som_t* som, bool per_feature, uint32 rerank) {
+	if (som->weights.cols > AD_CODEBOOK_MAX_COLS) {
+		fprintf(stderr, "maps wider than %d features can't be scored through a codebook, using the float weights\n", AD_CODEBOOK_MAX_COLS);
+		return;
+	}
+
+	som->codebook = new codebook_t();
+	som->codebook->dense_find_bmu = som->kernels.find_bmu;
+	cb_init(som->codebook, som->weights, per_feature);
+	som->codebook->rerank = rerank ? rerank : AD_CODEBOOK_RERANK;
+	if (som->codebook->rerank > AD_CODEBOOK_MAX_RERANK) som->codebook->rerank = AD_CODEBOOK_MAX_RERANK;
+	som->kernels.find_bmu = &cb_find_bmu;
+}
+
+void som_codebook_free(som_t* som) {
+	if (!som->codebook) return;
+	som->kernels.find_bmu = som->codebook->dense_find_bmu;
+	cb_free(som->codebook);
+	delete som->codebook;
+	som->codebook = nullptr;
+}
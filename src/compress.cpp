@@ -0,0 +1,338 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+
+#include "types.hpp"
+#include "pack.hpp"
+#include "math.hpp"
+#include "som.hpp"
+#include "model.hpp"
+#include "utils.hpp"
+#include "platform.hpp"
+
+#define AD_FLAG_MODEL "-m"
+#define AD_FLAG_ENCODE "-e"
+#define AD_FLAG_DECODE "-d"
+#define AD_FLAG_OUTPUT "-o"
+#define AD_FLAG_RESIDUALS "-r"
+#define AD_FLAG_THREADS "-t"
+#define AD_FLAG_VERIFY "-v"
+#define AD_FLAG_HELP "-h"
+
+// A compressed dataset in memory, one entry per row in each section; see ad_compressed_header
+struct compressed_rows_t {
+	ad_compressed_header header;
+	std::vector<uint32> winners;
+	std::vector<float32> lengths;
+	std::vector<uint16> scores;
+	std::vector<float32> scales;
+	std::vector<int8> residuals;
+};
+
+
+// Encoding
+void encode_row(som_t* som, vector_t& row, uint32 index, compressed_rows_t* compressed) {
+	compressed->lengths[index] = vec_length(row);
+	vec_normalize(row);
+
+	bmu_t bmu;
+	som->kernels.find_bmu(som, row, &bmu);
+	compressed->winners[index] = bmu.winner;
+	compressed->scores[index] = f32_to_bf16(bmu.distance);
+	if (!compressed->header.residuals) return;
+
+	// Residuals are quantized against their own largest magnitude, so each row uses the full int8 range
+	uint32 cols = row.size;
+	float32* weight = mtx_at(som->weights, bmu.winner, 0);
+	float32 largest = 0;
+	for (uint32 i = 0; i < cols; i++) largest = fmax(largest, fabs(row[i] - weight[i]));
+
+	float32 scale = largest / 127;
+	int8* residual = compressed->residuals.data() + (uint64)index * cols;
+	for (uint32 i = 0; i < cols; i++) residual[i] = scale ? (int8)lrintf((row[i] - weight[i]) / scale) : 0;
+	compressed->scales[index] = scale;
+}
+
+void encode(som_t* som, char* input, compressed_rows_t* compressed, uint32 threads) {
+	ad_featurized_header* header = (ad_featurized_header*)input;
+	uint32 rows = header->rows;
+	uint32 cols = header->features_per_row;
+
+	compressed->header.rows = rows;
+	compressed->header.features_per_row = cols;
+	compressed->header.clusters = som->weights.rows;
+	compressed->header.winner_bytes = som->weights.rows <= 0xFFFF ? sizeof(uint16) : sizeof(uint32);
+	compressed->winners.resize(rows);
+	compressed->lengths.resize(rows);
+	compressed->scores.resize(rows);
+	if (compressed->header.residuals) {
+		compressed->scales.resize(rows);
+		compressed->residuals.resize((uint64)rows * cols);
+	}
+
+	// Sparse rows are expanded into a dense scratch row, like scoring does
+	bool sparse = header->layout == ad_featurized_layout::ad_sparse;
+	uint32* offsets = (uint32*)(input + sizeof(ad_featurized_header));
+	uint32* columns = offsets + rows + 1;
+	float32* values = sparse ? (float32*)(columns + header->nonzeros) : (float32*)offsets;
+
+	ad_parallel_for(rows, threads, [&](uint32 begin, uint32 end, uint32) {
+		vector_t scratch;
+		vec_init(&scratch, cols);
+		for (uint32 row = begin; row < end; row++) {
+			if (sparse) {
+				memset(scratch.data, 0, cols * sizeof(float32));
+				for (uint32 i = offsets[row]; i < offsets[row + 1]; i++) scratch[columns[i]] = values[i];
+			}
+			else {
+				memcpy(scratch.data, values + (uint64)row * cols, cols * sizeof(float32));
+			}
+			encode_row(som, scratch, row, compressed);
+		}
+		vec_free(scratch);
+	});
+}
+
+uint64 compressed_size(ad_compressed_header* header) {
+	uint64 per_row = header->winner_bytes + sizeof(float32) + sizeof(uint16);
+	if (header->residuals) per_row += sizeof(float32) + header->features_per_row;
+	return sizeof(ad_compressed_header) + per_row * header->rows;
+}
+
+ad_return_t write_compressed(compressed_rows_t* compressed, const char* path) {
+	FILE* file = fopen(path, "wb");
+	if (!file) return AD_RETURN_BAD_FILE;
+
+	uint32 rows = compressed->header.rows;
+	fwrite(&compressed->header, sizeof(ad_compressed_header), 1, file);
+	if (compressed->header.winner_bytes == sizeof(uint16)) {
+		std::vector<uint16> narrow(compressed->winners.begin(), compressed->winners.end());
+		fwrite(narrow.data(), sizeof(uint16), rows, file);
+	}
+	else {
+		fwrite(compressed->winners.data(), sizeof(uint32), rows, file);
+	}
+	fwrite(compressed->lengths.data(), sizeof(float32), rows, file);
+	fwrite(compressed->scores.data(), sizeof(uint16), rows, file);
+	if (compressed->header.residuals) {
+		fwrite(compressed->scales.data(), sizeof(float32), rows, file);
+		fwrite(compressed->residuals.data(), sizeof(int8), compressed->residuals.size(), file);
+	}
+	return fclose(file) ? AD_RETURN_BAD_FILE : AD_RETURN_SUCCESS;
+}
+
+
+// Decoding
+ad_return_t read_compressed(compressed_rows_t* compressed, const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (!file) return AD_RETURN_BAD_FILE;
+
+	// The header is checked before anything is sized from it
+	ad_compressed_header* header = &compressed->header;
+	bool valid = fread(header, sizeof(ad_compressed_header), 1, file) == 1;
+	valid = valid && header->file_magic == ad_compressed_header::magic;
+	valid = valid && header->file_version == ad_compressed_header::version;
+	valid = valid && header->rows >= 0 && header->features_per_row >= 0 && header->clusters > 0;
+	valid = valid && (header->winner_bytes == sizeof(uint16) || header->winner_bytes == sizeof(uint32));
+	if (!valid) {
+		fclose(file);
+		return AD_RETURN_BAD_HEADER;
+	}
+
+	uint32 rows = compressed->header.rows;
+	compressed->winners.resize(rows);
+	compressed->lengths.resize(rows);
+	compressed->scores.resize(rows);
+	if (compressed->header.winner_bytes == sizeof(uint16)) {
+		std::vector<uint16> narrow(rows);
+		valid = valid && fread(narrow.data(), sizeof(uint16), rows, file) == rows;
+		for (uint32 row = 0; row < rows; row++) compressed->winners[row] = narrow[row];
+	}
+	else {
+		valid = valid && fread(compressed->winners.data(), sizeof(uint32), rows, file) == rows;
+	}
+	valid = valid && fread(compressed->lengths.data(), sizeof(float32), rows, file) == rows;
+	valid = valid && fread(compressed->scores.data(), sizeof(uint16), rows, file) == rows;
+	if (compressed->header.residuals) {
+		uint64 size = (uint64)rows * compressed->header.features_per_row;
+		compressed->scales.resize(rows);
+		compressed->residuals.resize(size);
+		valid = valid && fread(compressed->scales.data(), sizeof(float32), rows, file) == rows;
+		valid = valid && fread(compressed->residuals.data(), sizeof(int8), size, file) == size;
+	}
+	fclose(file);
+	return valid ? AD_RETURN_SUCCESS : AD_RETURN_BAD_FILE;
+}
+
+// Whether compressed rows can be decoded against this model: it's the one they were encoded with, and every
+// winner is one of its units. Prints why not, naming path, if they can't.
+bool compressed_matches(compressed_rows_t* compressed, ad_model_t* model, const char* path) {
+	ad_compressed_header* header = &compressed->header;
+	if (header->model_checksum != model->header->checksum) {
+		fprintf(stderr, "dataset was compressed with a different model, path = %s\n", path);
+		return false;
+	}
+
+	uint32 clusters = model->weights.rows;
+	bool valid = header->clusters == (int32)clusters;
+	valid &= header->features_per_row == (int32)model->weights.cols;
+	valid &= header->winner_bytes == (int32)(clusters <= 0xFFFF ? sizeof(uint16) : sizeof(uint32));
+	for (uint32 winner : compressed->winners) valid &= winner < clusters;
+	if (!valid) fprintf(stderr, "compressed file is corrupt, path = %s\n", path);
+	return valid;
+}
+
+// Each row comes back as its winner plus its residual, scaled back up to its original length
+void decode(ad_model_t* model, compressed_rows_t* compressed, std::vector<float32>* output) {
+	uint32 rows = compressed->header.rows;
+	uint32 cols = compressed->header.features_per_row;
+	output->resize((uint64)rows * cols);
+
+	for (uint32 row = 0; row < rows; row++) {
+		float32* weight = mtx_at(model->weights, compressed->winners[row], 0);
+		float32* out = output->data() + (uint64)row * cols;
+		float32 length = compressed->lengths[row];
+		if (compressed->header.residuals) {
+			float32 scale = compressed->scales[row];
+			int8* residual = compressed->residuals.data() + (uint64)row * cols;
+			for (uint32 i = 0; i < cols; i++) out[i] = length * (weight[i] + scale * residual[i]);
+		}
+		else {
+			for (uint32 i = 0; i < cols; i++) out[i] = length * weight[i];
+		}
+	}
+}
+
+
+// CLI
+const char* help =
+	"ad_compress: encode a featurized dataset as the winners of a trained model, or decode one back\n\n"
+
+	"usage:\n"
+	"  -m [model_path]: required, path to a model written by ad_train\n"
+	"  -e [input_path]: encode this featurized dataset\n"
+	"  -d [input_path]: decode this compressed dataset into a dense featurized dataset\n"
+	"  -o [output_path]: required, where to write the result\n"
+	"  -r: when encoding, keep an 8 bit residual for every feature, so rows decode close to the originals\n"
+	"  -t [threads]: encoding threads, default one per hardware thread\n"
+	"  -v: check the model's checksum first, which reads the whole file";
+
+int main(int arg_count, char** args) {
+	char model_path  [AD_PATH_SIZE] = { 0 };
+	char encode_path [AD_PATH_SIZE] = { 0 };
+	char decode_path [AD_PATH_SIZE] = { 0 };
+	char output_path [AD_PATH_SIZE] = { 0 };
+	bool residuals = false;
+	uint32 threads = 0;
+	bool verify = false;
+
+	for (int32 i = 1; i < arg_count; i++) {
+		char* flag = args[i];
+		if (!strcmp(flag, AD_FLAG_MODEL)) {
+			strncpy(model_path, args[++i], AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_ENCODE)) {
+			strncpy(encode_path, args[++i], AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_DECODE)) {
+			strncpy(decode_path, args[++i], AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_OUTPUT)) {
+			strncpy(output_path, args[++i], AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_RESIDUALS)) {
+			residuals = true;
+		}
+		else if (!strcmp(flag, AD_FLAG_THREADS)) {
+			threads = atoi(args[++i]);
+		}
+		else if (!strcmp(flag, AD_FLAG_VERIFY)) {
+			verify = true;
+		}
+		else if (!strcmp(flag, AD_FLAG_HELP)) {
+			printf("%s\n", help);
+			exit(0);
+		}
+	}
+
+	if (!strlen(model_path) || !strlen(output_path) || !strlen(encode_path) == !strlen(decode_path)) {
+		printf("%s\n", help);
+		exit(1);
+	}
+
+	ad_model_t model;
+	if (model_load(&model, model_path)) {
+		fprintf(stderr, "cannot load model, path = %s\n", model_path);
+		exit(1);
+	}
+	if (verify && !model_verify(&model)) {
+		fprintf(stderr, "model is corrupt, its checksum doesn't match, path = %s\n", model_path);
+		exit(1);
+	}
+
+	// Residuals are taken against the weights, so rows have to live in the same space as them
+	if (model.header->projection != projection_kind::none) {
+		fprintf(stderr, "model was trained on reduced inputs, so rows can't be encoded against it\n");
+		exit(1);
+	}
+
+	compressed_rows_t compressed;
+	if (strlen(encode_path)) {
+		uint64 input_size;
+		char* input = (char*)ad_map_file(encode_path, &input_size);
+		if (!input) {
+			fprintf(stderr, "cannot open input file, path = %s\n", encode_path);
+			exit(1);
+		}
+
+		ad_featurized_header* header = (ad_featurized_header*)input;
+		if (!featurized_valid(header, input_size, encode_path)) exit(1);
+		if (header->features_per_row != (int32)model.weights.cols) {
+			fprintf(stderr, "dataset has %d features per row, but the model was trained on %d\n", header->features_per_row, model.weights.cols);
+			exit(1);
+		}
+
+		som_t som;
+		som_init(&som, &model);
+		compressed.header.residuals = residuals;
+		compressed.header.model_checksum = model.header->checksum;
+		encode(&som, input, &compressed, threads);
+		if (write_compressed(&compressed, output_path)) {
+			fprintf(stderr, "cannot write output file, path = %s\n", output_path);
+			exit(1);
+		}
+
+		uint64 output_size = compressed_size(&compressed.header);
+		printf("encoded %d rows: %llu bytes to %llu bytes (%.1fx)\n",
+			   header->rows, (unsigned long long)input_size, (unsigned long long)output_size, (float64)input_size / output_size);
+		ad_unmap_file(input, input_size);
+	}
+	else {
+		if (read_compressed(&compressed, decode_path)) {
+			fprintf(stderr, "cannot read compressed file, path = %s\n", decode_path);
+			exit(1);
+		}
+		if (!compressed_matches(&compressed, &model, decode_path)) exit(1);
+
+		std::vector<float32> rows;
+		decode(&model, &compressed, &rows);
+
+		ad_featurized_header header;
+		header.rows = compressed.header.rows;
+		header.features_per_row = compressed.header.features_per_row;
+		FILE* file = fopen(output_path, "wb");
+		if (!file) {
+			fprintf(stderr, "cannot open output file, path = %s\n", output_path);
+			exit(1);
+		}
+		fwrite(&header, sizeof(ad_featurized_header), 1, file);
+		fwrite(rows.data(), sizeof(float32), rows.size(), file);
+		fclose(file);
+		printf("decoded %d rows\n", header.rows);
+	}
+
+	model_free(&model);
+	return 0;
+}
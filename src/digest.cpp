@@ -0,0 +1,109 @@
+#include <cmath>
+#include <float.h>
+#include <algorithm>
+#include <cassert>
+
+#include "digest.hpp"
+
+void td_init(tdigest_t* td) {
+	td->centroids = 0;
+	td->buffered = 0;
+	td->min = FLT_MAX;
+	td->max = -FLT_MAX;
+	td->total = 0;
+}
+
+void td_add(tdigest_t* td, float32 value) {
+	td->buffer[td->buffered++] = value;
+	if (td->buffered == AD_DIGEST_BUFFER) td_flush(td);
+}
+
+float64 td_count(tdigest_t* td) {
+	return td->total + td->buffered;
+}
+
+// Merge the sorted buffer into the centroids, then walk them in order and combine neighbors for as long as
+// the combined centroid spans at most one unit of the scale function k(q) = d / Z * log(q / (1 - q)), where
+// Z = 4 log(n / d) + 24. That allows big centroids in the middle and single values at the far tails.
+void td_flush(tdigest_t* td) {
+	if (!td->buffered) return;
+
+	std::sort(td->buffer, td->buffer + td->buffered);
+	td->min = fmin(td->min, td->buffer[0]);
+	td->max = fmax(td->max, td->buffer[td->buffered - 1]);
+
+	float32 means   [AD_DIGEST_CENTROIDS + AD_DIGEST_BUFFER];
+	float64 weights [AD_DIGEST_CENTROIDS + AD_DIGEST_BUFFER];
+	uint32 count = 0;
+	for (uint32 i = 0, j = 0; i < td->centroids || j < td->buffered; count++) {
+		if (j == td->buffered || (i < td->centroids && td->means[i] <= td->buffer[j])) {
+			means[count] = td->means[i];
+			weights[count] = td->weights[i++];
+		}
+		else {
+			means[count] = td->buffer[j++];
+			weights[count] = 1;
+		}
+	}
+
+	float64 total = td->total + td->buffered;
+	float64 compression = AD_DIGEST_COMPRESSION;
+	float64 normalizer = compression / (4 * log(total / compression) + 24);
+	auto q_limit = [&](float64 q) {
+		float64 k = normalizer * log(q / (1 - q)) + 1;
+		return 1 / (1 + exp(-k / normalizer));
+	};
+
+	uint32 out = 0;
+	float64 so_far = 0;
+	float64 limit = q_limit(0);
+	td->means[0] = means[0];
+	td->weights[0] = weights[0];
+	for (uint32 i = 1; i < count; i++) {
+		float64 proposed = td->weights[out] + weights[i];
+		if ((so_far + proposed) / total <= limit || out == AD_DIGEST_CENTROIDS - 1) {
+			td->means[out] += (means[i] - td->means[out]) * weights[i] / proposed;
+			td->weights[out] = proposed;
+		}
+		else {
+			so_far += td->weights[out];
+			limit = q_limit(so_far / total);
+			out++;
+			td->means[out] = means[i];
+			td->weights[out] = weights[i];
+		}
+	}
+
+	td->centroids = out + 1;
+	td->total = total;
+	td->buffered = 0;
+}
+
+// Interpolate between centroid centers; past the first and last centers, interpolate toward the exact
+// min and max
+float32 td_quantile(tdigest_t* td, float64 q) {
+	assert(!td->buffered);
+	if (!td->centroids) return 0;
+	if (td->centroids == 1) return td->means[0];
+
+	float64 target = fmin(fmax(q, 0), 1) * td->total;
+	float64 first = td->weights[0] / 2;
+	if (target < first) {
+		return td->min + (td->means[0] - td->min) * target / first;
+	}
+
+	float64 so_far = 0;
+	for (uint32 i = 0; i + 1 < td->centroids; i++) {
+		float64 left = so_far + td->weights[i] / 2;
+		float64 right = so_far + td->weights[i] + td->weights[i + 1] / 2;
+		if (target <= right) {
+			return td->means[i] + (td->means[i + 1] - td->means[i]) * (target - left) / (right - left);
+		}
+		so_far += td->weights[i];
+	}
+
+	uint32 last = td->centroids - 1;
+	float64 half = td->weights[last] / 2;
+	float64 t = fmin((target - (td->total - half)) / half, 1);
+	return td->means[last] + (td->max - td->means[last]) * t;
+}
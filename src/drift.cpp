@@ -0,0 +1,115 @@
+#include <cstring>
+#include <cmath>
+
+#include "drift.hpp"
+#include "digest.hpp"
+#include "utils.hpp"
+
+// Shares of zero would make PSI infinite, so both sides are floored at this
+#define AD_DRIFT_FLOOR 1e-4f
+
+void drift_baseline_init(drift_baseline_t* baseline, ad_model_t* model) {
+	uint32 clusters = model->header->clusters;
+	float64 total = 0;
+	for (uint32 cluster = 0; cluster < clusters; cluster++) total += model->stats[cluster].hits;
+
+	vec_init(&baseline->hit_rates, clusters);
+	for (uint32 cluster = 0; cluster < clusters; cluster++) {
+		baseline->hit_rates[cluster] = total ? model->stats[cluster].hits / total : 1.f / clusters;
+	}
+
+	baseline->edges = (float32*)ad_aligned_alloc((uint64)clusters * AD_DRIFT_BINS * sizeof(float32), 64);
+	for (uint32 cluster = 0; cluster < clusters; cluster++) {
+		tdigest_t* digest = td_count(&model->cluster_digests[cluster]) ? &model->cluster_digests[cluster] : model->error_digest;
+		float32* edges = baseline->edges + cluster * AD_DRIFT_BINS;
+		for (uint32 i = 0; i < AD_DRIFT_BINS - 1; i++) edges[i] = td_quantile(digest, (i + 1.0) / AD_DRIFT_BINS);
+		edges[AD_DRIFT_BINS - 1] = INFINITY;
+	}
+}
+
+void drift_baseline_free(drift_baseline_t* baseline) {
+	vec_free(baseline->hit_rates);
+	ad_aligned_free(baseline->edges);
+	baseline->edges = nullptr;
+}
+
+void drift_init(drift_monitor_t* monitor, drift_baseline_t* baseline) {
+	monitor->baseline = baseline;
+	arr_init(&monitor->bins, baseline->hit_rates.size * AD_DRIFT_BINS, (uint32)0);
+	monitor->rows = 0;
+}
+
+void drift_free(drift_monitor_t* monitor) {
+	arr_free(&monitor->bins);
+}
+
+void drift_merge(drift_monitor_t* into, drift_monitor_t* from) {
+	for (int32 i = 0; i < into->bins.size; i++) into->bins.data[i] += from->bins.data[i];
+	into->rows += from->rows;
+
+	memset(from->bins.data, 0, arr_bytes(&from->bins));
+	from->rows = 0;
+}
+
+float32 drift_psi_term(float32 expected, float32 observed) {
+	expected = fmax(expected, AD_DRIFT_FLOOR);
+	observed = fmax(observed, AD_DRIFT_FLOOR);
+	return (observed - expected) * log(observed / expected);
+}
+
+// PSI and KS of one set of bin counts against the equal shares every unit's bins expect
+void drift_error_stats(uint32* bins, float32 rows, float32* psi, float32* ks) {
+	float32 expected = 1.f / AD_DRIFT_BINS;
+	float32 cumulative = 0;
+	*psi = 0;
+	*ks = 0;
+	for (uint32 bin = 0; bin < AD_DRIFT_BINS; bin++) {
+		float32 observed = bins[bin] / rows;
+		*psi += drift_psi_term(expected, observed);
+
+		cumulative += observed;
+		*ks = fmax(*ks, fabs(cumulative - expected * (bin + 1)));
+	}
+}
+
+drift_report_t drift_check(drift_monitor_t* monitor, config_t* config) {
+	drift_report_t report;
+	report.rows = monitor->rows;
+	if (!monitor->rows) return report;
+
+	uint32 clusters = monitor->baseline->hit_rates.size;
+	float32 rows = monitor->rows;
+	uint32 pooled [AD_DRIFT_BINS] = { 0 };
+	uint32 weighed = 0;
+	for (uint32 cluster = 0; cluster < clusters; cluster++) {
+		uint32* bins = monitor->bins.data + cluster * AD_DRIFT_BINS;
+		uint32 hits = 0;
+		for (uint32 bin = 0; bin < AD_DRIFT_BINS; bin++) {
+			hits += bins[bin];
+			pooled[bin] += bins[bin];
+		}
+		report.hit_psi += drift_psi_term(monitor->baseline->hit_rates[cluster], hits / rows);
+		if (hits < AD_DRIFT_MIN_ROWS) continue;
+
+		float32 psi, ks;
+		drift_error_stats(bins, hits, &psi, &ks);
+		report.error_psi += psi * hits;
+		report.error_ks += ks * hits;
+		weighed += hits;
+	}
+
+	if (weighed) {
+		report.error_psi /= weighed;
+		report.error_ks /= weighed;
+	} else {
+		drift_error_stats(pooled, rows, &report.error_psi, &report.error_ks);
+	}
+
+	float32 psi_threshold = config->drift_psi ? config->drift_psi : AD_DRIFT_PSI;
+	float32 ks_threshold = config->drift_ks ? config->drift_ks : AD_DRIFT_KS;
+	report.retrain = report.hit_psi > psi_threshold || report.error_psi > psi_threshold || report.error_ks > ks_threshold;
+
+	memset(monitor->bins.data, 0, arr_bytes(&monitor->bins));
+	monitor->rows = 0;
+	return report;
+}
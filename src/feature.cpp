@@ -26,6 +26,19 @@ ad_return_t write_featurized_data(ad_featurized_header* header, std::vector<floa
 	return AD_RETURN_SUCCESS;
 }
 
+ad_return_t write_featurized_data(ad_featurized_header* header, ad_sparse_buffer* buffer, const char* path) {
+	FILE* file = fopen(path, "w+");
+	if (!file) return AD_RETURN_BAD_FILE;
+
+	fwrite(header, sizeof(ad_featurized_header), 1, file);
+	fwrite(buffer->offsets.data(), buffer->offsets.size() * sizeof(uint32), 1, file);
+	fwrite(buffer->columns.data(), buffer->columns.size() * sizeof(uint32), 1, file);
+	fwrite(buffer->values.data(), buffer->values.size() * sizeof(float32), 1, file);
+	fclose(file);
+
+	return AD_RETURN_SUCCESS;
+}
+
 
 // Featurize functions. These take different input types and convert them to one or more
 // floating point numbers
@@ -61,6 +74,20 @@ uint32 ad_featurize_path(std::vector<float32>* buffer, char* path) {
 
 
 
+// Featurize a single raw feature into the buffer. Returns how many floats were written.
+uint32 ad_featurize_feature(std::vector<float32>* buffer, ad_feature* feature, void* data, bool quiet) {
+	if (feature->type == ad_feature_type::ad_float) {
+		if (!quiet) printf("float: %f\n", *(float*)data);
+		return ad_featurize_float(buffer, (float*)data);
+	}
+	else if (feature->type == ad_feature_type::ad_path) {
+		if (!quiet) printf("path: %s\n", (char*)data);
+		return ad_featurize_path(buffer, (char*)data);
+	}
+
+	return 0;
+}
+
 // Public API: Featurize some data into a buffer. The data may come from a file (specified in the config),
 // or it may come from an in-memory buffer.
 void ad_featurize(ad_unpack_context* context, std::vector<float32>* output_buffer, ad_featurized_header* header, bool quiet) {
@@ -84,22 +111,58 @@ void ad_featurize(ad_unpack_context* context, std::vector<float32>* output_buffe
 			assert(header->features_per_row == features_written_row);
 			features_written_row = 0;
 		}
-		else if (feature->type == ad_feature_type::ad_float) {
-			if (!quiet) printf("float: %f\n", *(float*)data);
-
-			uint32 count = ad_featurize_float(output_buffer, (float*)data);
-			features_written_row += count;
-		}
-		else if (feature->type == ad_feature_type::ad_path) {
-			if (!quiet) printf("path: %s\n", (char*)data);
-			uint32 count = ad_featurize_path(output_buffer, (char*)data);
-			features_written_row += count;
+		else {
+			features_written_row += ad_featurize_feature(output_buffer, feature, data, quiet);
 		}
 	}
 	
 	if (!quiet) printf("featurizing done, rows = %d, features per row = %d", header->rows, header->features_per_row);
 }
 
+// Same as above, but only the nonzero features are kept. Each row is featurized into a scratch buffer
+// and compressed into the output when the next row starts, so nothing the size of the dense dataset
+// is ever allocated.
+void ad_featurize(ad_unpack_context* context, ad_sparse_buffer* output_buffer, ad_featurized_header* header, bool quiet) {
+	std::vector<float32> row;
+
+	auto flush_row = [&]() {
+		if (!header->rows) return;
+		if (header->rows == 1) header->features_per_row = row.size();
+		assert(header->features_per_row == row.size());
+
+		for (uint32 i = 0; i < row.size(); i++) {
+			if (row[i] == 0) continue;
+			output_buffer->columns.push_back(i);
+			output_buffer->values.push_back(row[i]);
+		}
+		output_buffer->offsets.push_back(output_buffer->values.size());
+		row.clear();
+	};
+
+	header->layout = ad_featurized_layout::ad_sparse;
+	output_buffer->offsets.push_back(0);
+
+	ad_feature* feature = nullptr;
+	void* data = nullptr;
+	while (!unpack_ctx_done(context)) {
+		ad_return_t code = unpack_ctx_next(context, &feature, &data);
+		if (code) { fprintf(stderr, "unpack error, code = %d\n", code); exit(1); }
+
+		if (feature->type == ad_feature_type::ad_row) {
+			if (!quiet) printf("row\n");
+			flush_row();
+			header->rows++;
+		}
+		else {
+			ad_featurize_feature(&row, feature, data, quiet);
+		}
+	}
+	flush_row();
+
+	header->nonzeros = output_buffer->values.size();
+	if (!quiet) printf("featurizing done, rows = %d, features per row = %d, nonzeros = %d", header->rows, header->features_per_row, header->nonzeros);
+}
+
 void ad_featurize(config_t* config, std::vector<float32>* buffer) {
 	static char input_path  [AD_PATH_SIZE];
 	static char output_path [AD_PATH_SIZE];
@@ -113,6 +176,13 @@ void ad_featurize(config_t* config, std::vector<float32>* buffer) {
 	}
 	
 	ad_featurized_header header;
+
+	if (config->sparse) {
+		ad_sparse_buffer sparse_buffer;
+		ad_featurize(&context, &sparse_buffer, &header, config->quiet);
+		if (config->write_output) write_featurized_data(&header, &sparse_buffer, output_path);
+		return;
+	}
 	
 	ad_featurize(&context, buffer, &header, config->quiet);
 	if (config->write_output) write_featurized_data(&header, buffer, output_path);
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <cmath>
 
 #include "glad/glad.h"
 #include <GLFW/glfw3.h>
@@ -40,6 +41,9 @@ struct anomaly_t {
 	// A list of clusters. Order is preserved between this array and the input datapoints.
 	vector_t results = { 0 };
 	bool has_results = false;
+
+	// What each cluster saw in the last training epoch
+	std::vector<cluster_stats_t> cluster_stats;
 };
 
 void init_memory(anomaly_t* anomaly) {
@@ -49,7 +53,7 @@ void init_memory(anomaly_t* anomaly) {
 	anomaly->input_data = nullptr;
 	anomaly->input_data_size = 0;
 	
-	memset(&anomaly->feature_header, 0, sizeof(ad_featurized_header));
+	anomaly->feature_header = ad_featurized_header();
 	if (anomaly->results.data) vec_free(anomaly->results);
 
 	// @spader: This is an arbitrary number. Any reasonable amount of data will overrun this.
@@ -260,6 +264,7 @@ int main (int argc, char** argv) {
 
 			vec_init(&anomaly.results, som.winners.size);
 			memcpy(anomaly.results.data, som.winners.data, som.winners.size * sizeof(float32));
+			anomaly.cluster_stats.assign(som.cluster_stats.data, som.cluster_stats.data + som.cluster_stats.size);
 			anomaly.has_results = true;
 		}
 
@@ -318,6 +323,37 @@ int main (int argc, char** argv) {
 				ImGui::EndTable();
 			}
 			ImGui::End();
+
+			// One row per cluster. Clusters with no hits are dead units.
+			ImGui::Begin("Clusters");
+			if (ImGui::BeginTable("Clusters", 5, table_flags)) {
+				ImGui::TableSetupColumn("Cluster");
+				ImGui::TableSetupColumn("Hits");
+				ImGui::TableSetupColumn("Mean distance");
+				ImGui::TableSetupColumn("Stddev");
+				ImGui::TableSetupColumn("Radius");
+				ImGui::TableHeadersRow();
+
+				for (uint32 cluster = 0; cluster < anomaly.cluster_stats.size(); cluster++) {
+					cluster_stats_t* stats = &anomaly.cluster_stats[cluster];
+					ImGui::TableNextRow();
+					ImU32 row_bg_color = ImGui::GetColorU32(cluster_colors[cluster % 16]);
+					ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg1, row_bg_color);
+
+					ImGui::TableNextColumn();
+					ImGui::Text("%d", cluster);
+					ImGui::TableNextColumn();
+					ImGui::Text("%d", stats->hits);
+					ImGui::TableNextColumn();
+					ImGui::Text("%f", stats->mean);
+					ImGui::TableNextColumn();
+					ImGui::Text("%f", sqrt(cluster_stats_variance(stats)));
+					ImGui::TableNextColumn();
+					ImGui::Text("%f", stats->radius);
+				}
+				ImGui::EndTable();
+			}
+			ImGui::End();
 		}
 		ImGui::End();
 
@@ -0,0 +1,180 @@
+#include <cstring>
+#include <cmath>
+#include <float.h>
+#include <vector>
+
+#include "kmeans.hpp"
+#include "utils.hpp"
+
+uint32 kmeans_rows(som_t* som) {
+	return som->input_order.capacity;
+}
+
+// A dense view of one input. Half precision rows are widened into the worker's scratch.
+vector_t kmeans_dense_row(som_t* som, som_worker_t* worker, uint32 row) {
+	if (!som->is_half) return mtx_at(som->inputs, row);
+	hmtx_load(som->half_inputs, row, worker->input_scratch);
+	return worker->input_scratch;
+}
+
+// Squared distance from one input to one unit under the SOM's metric, which is what k-means++ weights its
+// picks by. Sparse inputs use the expanded form, so the unit's norm has to be current. L1 distances are
+// squared here; cosine's 1 - x.w is already half the squared distance between normalized rows, but rounding
+// can take it, like the expanded form, just below zero.
+float32 kmeans_distance(som_t* som, som_worker_t* worker, uint32 row, uint32 cluster) {
+	vector_t weight = mtx_at(som->weights, cluster);
+	if (som->is_sparse) {
+		sparse_vector_t input = spm_at(som->sparse_inputs, row);
+		float32 distance = squared_error(weight, som->weight_norms[cluster], input);
+		return distance > 0 ? distance : 0;
+	}
+
+	vector_t input = kmeans_dense_row(som, worker, row);
+	float32 distance = som->kernels.distance_bounded(som, input.data, weight.data, FLT_MAX);
+	if (distance < 0) return 0;
+	return som->metric == distance_metric::l1 ? distance * distance : distance;
+}
+
+void kmeans_copy_row(som_t* som, uint32 row, uint32 cluster) {
+	vector_t weight = mtx_at(som->weights, cluster);
+	if (som->is_sparse) {
+		sparse_vector_t input = spm_at(som->sparse_inputs, row);
+		memset(weight.data, 0, weight.size * sizeof(float32));
+		spv_for(input, i) weight[input.indices[i]] = input.values[i];
+		return;
+	}
+
+	vector_t input = kmeans_dense_row(som, som->workers[0], row);
+	memcpy(weight.data, input.data, weight.size * sizeof(float32));
+}
+
+// k-means++. Keeping each input's distance to its nearest unit so far makes every pick one pass over the
+// inputs, against the new unit only.
+void kmeans_seed(som_t* som) {
+	uint32 rows = kmeans_rows(som);
+	uint32 clusters = som->weights.rows;
+	if (!rows) return;
+
+	std::vector<float32> nearest(rows, FLT_MAX);
+	for (uint32 cluster = 0; cluster < clusters; cluster++) {
+		// The first unit is any input; if every input already sits on a unit, so is the next
+		float64 total = 0;
+		for (uint32 row = 0; row < rows; row++) total += cluster ? nearest[row] : 0;
+
+		uint32 pick = rows - 1;
+		if (total > 0) {
+			float64 target = rng_float32(&som->rng) * total;
+			for (uint32 row = 0; row < rows; row++) {
+				target -= nearest[row];
+				if (target < 0) {
+					pick = row;
+					break;
+				}
+			}
+		}
+		else {
+			pick = rng_below(&som->rng, rows);
+		}
+
+		kmeans_copy_row(som, pick, cluster);
+		if (som->is_sparse) update_weight_norms(som);
+
+		ad_parallel_for(rows, som->workers.size, [&](uint32 begin, uint32 end, uint32 thread) {
+			for (uint32 row = begin; row < end; row++) {
+				float32 distance = kmeans_distance(som, som->workers[thread], row, cluster);
+				if (distance < nearest[row]) nearest[row] = distance;
+			}
+		});
+	}
+
+	if (som->is_soa) soa_from_mtx(som->soa_weights, som->weights);
+}
+
+// Find one input's winner and add the input to the winner's sum in the worker's deltas
+void kmeans_train_row(som_t* som, som_worker_t* worker, uint32 row, uint32* hits) {
+	bmu_t bmu;
+	if (som->is_sparse) {
+		sparse_vector_t input = spm_at(som->sparse_inputs, row);
+		find_bmu(som, input, &bmu);
+
+		float32* sum = mtx_at(worker->deltas, bmu.winner, 0);
+		spv_for(input, i) sum[input.indices[i]] += input.values[i];
+	}
+	else {
+		vector_t input = kmeans_dense_row(som, worker, row);
+		som->kernels.find_bmu(som, input, &bmu);
+
+		float32* sum = mtx_at(worker->deltas, bmu.winner, 0);
+		for (uint32 i = 0; i < input.size; i++) sum[i] += input[i];
+	}
+
+	hits[bmu.winner]++;
+	som->winners[row] = bmu.winner;
+	som->distances[row] = bmu.distance;
+	worker->epoch.quantization_error += bmu.distance;
+	cluster_stats_add(worker->stats[bmu.winner], som_stats_distance(som, bmu.distance));
+}
+
+som_epoch_t kmeans_iterate(som_t* som) {
+	som->iteration++;
+	som_shuffle(som);
+
+	arr_for(som->workers, worker) {
+		worker->epoch = som_epoch_t();
+		cluster_stats_reset(&worker->stats);
+	}
+
+	uint32 rows = som->input_order.size;
+	uint32 clusters = som->weights.rows;
+	uint32 batch = som->config.batch_size ? som->config.batch_size : AD_KMEANS_BATCH;
+	uint32* order = som->input_order.data;
+	std::vector<uint32> hits(som->workers.size * clusters);
+
+	for (uint32 begin = 0; begin < rows; begin += batch) {
+		uint32 end = rows - begin < batch ? rows : begin + batch;
+		if (som->is_sparse) update_weight_norms(som);
+
+		ad_parallel_for(end - begin, som->workers.size, [&](uint32 first, uint32 last, uint32 thread) {
+			uint32* worker_hits = hits.data() + thread * clusters;
+			for (uint32 i = begin + first; i < begin + last; i++) kmeans_train_row(som, som->workers[thread], order[i], worker_hits);
+		});
+
+		// Gather every worker's sums and hits into the first's, then move each unit that won anything to the
+		// running mean of everything it's won
+		for (uint32 thread = 1; thread < (uint32)som->workers.size; thread++) {
+			mtx_add(som->deltas, som->workers[thread]->deltas);
+			memset(som->workers[thread]->deltas.data, 0, sizeof(float32) * mtx_size(som->deltas));
+			for (uint32 cluster = 0; cluster < clusters; cluster++) {
+				hits[cluster] += hits[thread * clusters + cluster];
+				hits[thread * clusters + cluster] = 0;
+			}
+		}
+
+		for (uint32 cluster = 0; cluster < clusters; cluster++) {
+			if (!hits[cluster]) continue;
+
+			uint32* count = som->unit_counts.data + cluster;
+			*count += hits[cluster];
+			float32 rate = 1.f / *count;
+			vector_t weight = mtx_at(som->weights, cluster);
+			vector_t sum = mtx_at(som->deltas, cluster);
+			for (uint32 i = 0; i < weight.size; i++) weight[i] += rate * (sum[i] - hits[cluster] * weight[i]);
+
+			if (som->metric == distance_metric::cosine) vec_normalize(weight);
+			memset(sum.data, 0, sum.size * sizeof(float32));
+			hits[cluster] = 0;
+		}
+
+		if (som->is_soa) soa_from_mtx(som->soa_weights, som->weights);
+	}
+
+	som_epoch_t epoch;
+	cluster_stats_reset(&som->cluster_stats);
+	arr_for(som->workers, worker) {
+		epoch.quantization_error += worker->epoch.quantization_error;
+		for (uint32 cluster = 0; cluster < clusters; cluster++) {
+			cluster_stats_merge(som->cluster_stats[cluster], worker->stats[cluster]);
+		}
+	}
+	return epoch;
+}
@@ -10,8 +10,12 @@
 #ifdef _WIN32
 #include <assert.h>
 #endif
+#if defined(__AVX2__) || defined(__F16C__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 #include "math.hpp"
+#include "utils.hpp"
 
 void vec_init(vector_t* vector, float32* data, uint32 size) {
 	vector->data = data;
@@ -32,6 +36,7 @@ float32 vec_length(vector_t& vec) {
 
 void vec_normalize(vector_t& vec) {
 	float32 length = vec_length(vec);
+	if (!length) return;
 	for (uint32 i = 0; i < vec.size; i++) vec[i] /= length;
 }
 
@@ -122,3 +127,337 @@ void mtx_add(matrix_t& mtx, matrix_t& deltas) {
 uint32 mtx_size(matrix_t& mtx) {
 	return mtx.rows * mtx.cols;
 }
+
+float32 vec_length(sparse_vector_t& vec) {
+	float32 length = 0.f;
+	spv_for(vec, i) length += vec.values[i] * vec.values[i];
+	length = sqrt(length);
+	return length;
+}
+
+void vec_normalize(sparse_vector_t& vec) {
+	float32 length = vec_length(vec);
+	if (!length) return;
+	spv_for(vec, i) vec.values[i] /= length;
+}
+
+float32 vec_dot(sparse_vector_t& sparse, vector_t& dense) {
+	assert(sparse.size == dense.size);
+
+	float32 sum = 0;
+	spv_for(sparse, i) {
+		sum += sparse.values[i] * dense[sparse.indices[i]];
+	}
+	return sum;
+}
+
+void spm_init(sparse_matrix_t* spm, float32* values, uint32* columns, uint32* offsets, uint32 rows, uint32 cols) {
+	spm->values = values;
+	spm->columns = columns;
+	spm->offsets = offsets;
+	spm->rows = rows;
+	spm->cols = cols;
+	spm->nonzeros = offsets[rows];
+}
+
+sparse_vector_t spm_at(sparse_matrix_t& spm, uint32 row) {
+	sparse_vector_t vec;
+	uint32 begin = spm.offsets[row];
+	vec.values = spm.values + begin;
+	vec.indices = spm.columns + begin;
+	vec.nonzeros = spm.offsets[row + 1] - begin;
+	vec.size = spm.cols;
+	return vec;
+}
+
+float32 f16_to_f32(uint16 h) {
+	uint32 sign = (uint32)(h & 0x8000) << 16;
+	uint32 exponent = (h >> 10) & 0x1F;
+	uint32 mantissa = h & 0x3FF;
+
+	uint32 bits;
+	if (exponent == 0x1F) {
+		bits = sign | 0x7F800000 | (mantissa << 13);
+	}
+	else if (exponent) {
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	}
+	else if (mantissa) {
+		// Subnormal; shift the mantissa up until it's normalized
+		exponent = 113;
+		while (!(mantissa & 0x400)) { mantissa <<= 1; exponent--; }
+		bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+	}
+	else {
+		bits = sign;
+	}
+
+	float32 f;
+	memcpy(&f, &bits, sizeof(float32));
+	return f;
+}
+
+uint16 f32_to_f16(float32 f) {
+	uint32 bits;
+	memcpy(&bits, &f, sizeof(float32));
+
+	uint16 sign = (bits >> 16) & 0x8000;
+	int32 exponent = ((bits >> 23) & 0xFF) - 112;
+	uint32 mantissa = bits & 0x7FFFFF;
+
+	if (((bits >> 23) & 0xFF) == 0xFF) return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+	if (exponent >= 0x1F) return sign | 0x7C00;
+	if (exponent <= 0) {
+		if (exponent < -10) return sign;
+		mantissa |= 0x800000;
+		uint32 shift = 14 - exponent;
+		uint32 half = mantissa >> shift;
+		uint32 rest = mantissa & ((1 << shift) - 1);
+		uint32 midpoint = 1 << (shift - 1);
+		if (rest > midpoint || (rest == midpoint && (half & 1))) half++;
+		return sign | half;
+	}
+
+	// Round to nearest even; a carry out of the mantissa correctly bumps the exponent
+	uint32 half = (exponent << 10) | (mantissa >> 13);
+	uint32 rest = mantissa & 0x1FFF;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+	return sign | half;
+}
+
+float32 bf16_to_f32(uint16 h) {
+	uint32 bits = (uint32)h << 16;
+	float32 f;
+	memcpy(&f, &bits, sizeof(float32));
+	return f;
+}
+
+uint16 f32_to_bf16(float32 f) {
+	uint32 bits;
+	memcpy(&bits, &f, sizeof(float32));
+	if ((bits & 0x7FFFFFFF) > 0x7F800000) return (bits >> 16) | 0x40; // Keep NaNs quiet
+	bits += 0x7FFF + ((bits >> 16) & 1);
+	return bits >> 16;
+}
+
+void hmtx_init(half_matrix_t* mtx, matrix_t& source, half_format format) {
+	mtx->data = (uint16*)calloc(sizeof(uint16), mtx_size(source));
+	mtx->rows = source.rows;
+	mtx->cols = source.cols;
+	mtx->format = format;
+
+	uint32 size = mtx_size(source);
+	uint32 i = 0;
+#if defined(__F16C__)
+	if (format == half_format::fp16) {
+		for (; i + 8 <= size; i += 8) {
+			__m256 f = _mm256_loadu_ps(source.data + i);
+			_mm_storeu_si128((__m128i*)(mtx->data + i), _mm256_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT));
+		}
+	}
+#endif
+	for (; i < size; i++) {
+		mtx->data[i] = format == half_format::fp16 ? f32_to_f16(source.data[i]) : f32_to_bf16(source.data[i]);
+	}
+}
+
+void hmtx_load(half_matrix_t& mtx, uint32 row, vector_t& out) {
+	assert(out.size == mtx.cols);
+	uint16* in = mtx.data + (row * mtx.cols);
+
+	uint32 i = 0;
+	if (mtx.format == half_format::fp16) {
+#if defined(__F16C__)
+		for (; i + 8 <= mtx.cols; i += 8) {
+			__m128i h = _mm_loadu_si128((__m128i*)(in + i));
+			_mm256_storeu_ps(out.data + i, _mm256_cvtph_ps(h));
+		}
+#endif
+		for (; i < mtx.cols; i++) out[i] = f16_to_f32(in[i]);
+	}
+	else {
+#if defined(__AVX2__)
+		for (; i + 8 <= mtx.cols; i += 8) {
+			__m256i h = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i*)(in + i)));
+			_mm256_storeu_ps(out.data + i, _mm256_castsi256_ps(_mm256_slli_epi32(h, 16)));
+		}
+#endif
+		for (; i < mtx.cols; i++) out[i] = bf16_to_f32(in[i]);
+	}
+}
+
+void hmtx_free(half_matrix_t& mtx) {
+	free(mtx.data);
+	mtx.data = nullptr;
+	mtx.rows = 0;
+	mtx.cols = 0;
+}
+
+void soa_init(soa_matrix_t* soa, uint32 rows, uint32 cols) {
+	soa->rows = rows;
+	soa->cols = cols;
+	soa->stride = ad_align(rows, AD_SOA_LANES);
+	soa->data = (float32*)ad_aligned_alloc(soa->stride * cols * sizeof(float32), AD_SOA_ALIGNMENT);
+
+	// Padding rows are infinitely far from everything, so the kernels can run over them without masking
+	for (uint32 row = rows; row < soa->stride; row++) soa->data[row] = INFINITY;
+}
+
+void soa_from_mtx(soa_matrix_t& soa, matrix_t& mtx) {
+	assert(soa.rows == mtx.rows && soa.cols == mtx.cols);
+	for (uint32 row = 0; row < mtx.rows; row++) {
+		for (uint32 col = 0; col < mtx.cols; col++) {
+			soa.data[col * soa.stride + row] = *mtx_at(mtx, row, col);
+		}
+	}
+}
+
+void soa_to_mtx(soa_matrix_t& soa, matrix_t& mtx) {
+	assert(soa.rows == mtx.rows && soa.cols == mtx.cols);
+	for (uint32 row = 0; row < mtx.rows; row++) {
+		for (uint32 col = 0; col < mtx.cols; col++) {
+			*mtx_at(mtx, row, col) = soa.data[col * soa.stride + row];
+		}
+	}
+}
+
+void soa_free(soa_matrix_t& soa) {
+	ad_aligned_free(soa.data);
+	soa.data = nullptr;
+	soa.rows = 0;
+	soa.cols = 0;
+	soa.stride = 0;
+}
+
+// Find the row nearest to vec, and the row after it. Each pass of the inner loop advances the squared distance
+// of a whole block of rows by one feature; the two smallest distances and their indices are kept per lane and
+// reduced once at the end.
+uint32 soa_find_nearest(soa_matrix_t& soa, vector_t& vec, float32* distance, uint32* runner_up) {
+	assert(vec.size == soa.cols);
+
+#if defined(__AVX512F__)
+	__m512 best = _mm512_set1_ps(FLT_MAX);
+	__m512 second = _mm512_set1_ps(FLT_MAX);
+	__m512i best_index = _mm512_setzero_si512();
+	__m512i second_index = _mm512_setzero_si512();
+	__m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m512i step = _mm512_set1_epi32(16);
+	for (uint32 block = 0; block < soa.stride; block += 16) {
+		__m512 sum = _mm512_setzero_ps();
+		for (uint32 col = 0; col < soa.cols; col++) {
+			__m512 difference = _mm512_sub_ps(_mm512_load_ps(soa.data + col * soa.stride + block), _mm512_set1_ps(vec[col]));
+			sum = _mm512_fmadd_ps(difference, difference, sum);
+		}
+
+		// Anything closer than the best also bumps the old best down to second
+		__mmask16 beats_second = _mm512_cmp_ps_mask(sum, second, _CMP_LT_OQ);
+		__mmask16 beats_best = _mm512_cmp_ps_mask(sum, best, _CMP_LT_OQ);
+		second = _mm512_mask_blend_ps(beats_second, second, sum);
+		second_index = _mm512_mask_blend_epi32(beats_second, second_index, index);
+		second = _mm512_mask_blend_ps(beats_best, second, best);
+		second_index = _mm512_mask_blend_epi32(beats_best, second_index, best_index);
+		best = _mm512_mask_blend_ps(beats_best, best, sum);
+		best_index = _mm512_mask_blend_epi32(beats_best, best_index, index);
+		index = _mm512_add_epi32(index, step);
+	}
+
+	const uint32 count_lanes = 16;
+	float32 lanes [2 * count_lanes];
+	uint32 lane_indices [2 * count_lanes];
+	_mm512_storeu_ps(lanes, best);
+	_mm512_storeu_ps(lanes + count_lanes, second);
+	_mm512_storeu_si512(lane_indices, best_index);
+	_mm512_storeu_si512(lane_indices + count_lanes, second_index);
+#elif defined(__AVX2__)
+	__m256 best = _mm256_set1_ps(FLT_MAX);
+	__m256 second = _mm256_set1_ps(FLT_MAX);
+	__m256 best_index = _mm256_setzero_ps();
+	__m256 second_index = _mm256_setzero_ps();
+	__m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i step = _mm256_set1_epi32(8);
+	for (uint32 block = 0; block < soa.stride; block += 8) {
+		__m256 sum = _mm256_setzero_ps();
+		for (uint32 col = 0; col < soa.cols; col++) {
+			__m256 difference = _mm256_sub_ps(_mm256_load_ps(soa.data + col * soa.stride + block), _mm256_set1_ps(vec[col]));
+			sum = _mm256_add_ps(_mm256_mul_ps(difference, difference), sum);
+		}
+
+		// Indices ride along in float registers so they can share the blends
+		__m256 beats_second = _mm256_cmp_ps(sum, second, _CMP_LT_OQ);
+		__m256 beats_best = _mm256_cmp_ps(sum, best, _CMP_LT_OQ);
+		second = _mm256_blendv_ps(second, sum, beats_second);
+		second_index = _mm256_blendv_ps(second_index, _mm256_castsi256_ps(index), beats_second);
+		second = _mm256_blendv_ps(second, best, beats_best);
+		second_index = _mm256_blendv_ps(second_index, best_index, beats_best);
+		best = _mm256_blendv_ps(best, sum, beats_best);
+		best_index = _mm256_blendv_ps(best_index, _mm256_castsi256_ps(index), beats_best);
+		index = _mm256_add_epi32(index, step);
+	}
+
+	const uint32 count_lanes = 8;
+	float32 lanes [2 * count_lanes];
+	uint32 lane_indices [2 * count_lanes];
+	_mm256_storeu_ps(lanes, best);
+	_mm256_storeu_ps(lanes + count_lanes, second);
+	_mm256_storeu_ps((float32*)lane_indices, best_index);
+	_mm256_storeu_ps((float32*)(lane_indices + count_lanes), second_index);
+#else
+	const uint32 count_lanes = AD_SOA_LANES;
+	float32 lanes [2 * count_lanes];
+	uint32 lane_indices [2 * count_lanes];
+	for (uint32 lane = 0; lane < 2 * count_lanes; lane++) {
+		lanes[lane] = FLT_MAX;
+		lane_indices[lane] = 0;
+	}
+	for (uint32 block = 0; block < soa.stride; block += count_lanes) {
+		float32 sums [count_lanes] = { 0 };
+		for (uint32 col = 0; col < soa.cols; col++) {
+			float32* column = soa.data + col * soa.stride + block;
+			for (uint32 lane = 0; lane < count_lanes; lane++) {
+				float32 difference = column[lane] - vec[col];
+				sums[lane] += difference * difference;
+			}
+		}
+		for (uint32 lane = 0; lane < count_lanes; lane++) {
+			float32* best = lanes + lane;
+			float32* second = lanes + count_lanes + lane;
+			if (sums[lane] < *best) {
+				*second = *best;
+				lane_indices[count_lanes + lane] = lane_indices[lane];
+				*best = sums[lane];
+				lane_indices[lane] = block + lane;
+			}
+			else if (sums[lane] < *second) {
+				*second = sums[lane];
+				lane_indices[count_lanes + lane] = block + lane;
+			}
+		}
+	}
+#endif
+
+	// Ties go to the lowest index, to match the row-major search
+	uint32 nearest = 0;
+	uint32 nearest_lane = 0;
+	float32 min_distance = FLT_MAX;
+	for (uint32 lane = 0; lane < count_lanes; lane++) {
+		if (lanes[lane] < min_distance || (lanes[lane] == min_distance && lane_indices[lane] < nearest)) {
+			nearest = lane_indices[lane];
+			nearest_lane = lane;
+			min_distance = lanes[lane];
+		}
+	}
+
+	// The runner up is the best of every other lane's best, and the winning lane's second
+	*runner_up = nearest;
+	float32 second_distance = FLT_MAX;
+	for (uint32 lane = 0; lane < 2 * count_lanes; lane++) {
+		if (lane == nearest_lane) continue;
+		if (lanes[lane] < second_distance || (lanes[lane] == second_distance && lanes[lane] != FLT_MAX && lane_indices[lane] < *runner_up)) {
+			*runner_up = lane_indices[lane];
+			second_distance = lanes[lane];
+		}
+	}
+
+	*distance = min_distance;
+	return nearest;
+}
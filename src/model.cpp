@@ -0,0 +1,184 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "model.hpp"
+#include "platform.hpp"
+#include "utils.hpp"
+#include "digest.hpp"
+#include "pq.hpp"
+#include "codebook.hpp"
+
+uint32 ad_model_header::magic   = 0x4C444D41; // AMDL
+uint32 ad_model_header::version = 6;
+
+// Write the model to a temporary file and rename it into place, so anything mapping the old model keeps
+// a consistent view of it
+ad_return_t model_save(som_t* som, const char* path) {
+	ad_model_header header;
+	header.file_magic = ad_model_header::magic;
+	header.file_version = ad_model_header::version;
+	header.header_size = sizeof(ad_model_header);
+	header.topology = som->engine == som_engine::kmeans ? ad_topology::none : ad_topology::line;
+	header.clusters = som->weights.rows;
+	header.cols = som->weights.cols;
+	header.input_cols = som->weights.cols;
+	header.config = som->config;
+
+	uint64 weight_bytes = mtx_size(som->weights) * sizeof(float32);
+	uint64 stats_bytes = header.clusters * sizeof(cluster_stats_t);
+	uint64 digest_bytes = (header.clusters + 1) * sizeof(tdigest_t);
+	header.weights_offset = ad_align(sizeof(ad_model_header), AD_MODEL_ALIGNMENT);
+	header.stats_offset = header.weights_offset + weight_bytes;
+	header.digests_offset = ad_align(header.stats_offset + stats_bytes, AD_MODEL_ALIGNMENT);
+	header.file_size = header.digests_offset + digest_bytes;
+
+	uint64 projection_bytes = 0;
+	if (som->projection) {
+		projection_bytes = proj_bytes(som->projection);
+		header.input_cols = som->projection->input_cols;
+		header.projection = som->projection->kind;
+		header.projection_nonzeros = som->projection->nonzeros;
+		header.projection_offset = ad_align(header.file_size, AD_MODEL_ALIGNMENT);
+		header.file_size = header.projection_offset + projection_bytes;
+	}
+
+	// Winners and their distances are already known from the last epoch, so the error distributions don't
+	// need another pass over the data
+	std::vector<tdigest_t> digests(header.clusters + 1);
+	for (auto& digest : digests) td_init(&digest);
+	for (uint32 i = 0; i < som->winners.size; i++) {
+		uint32 cluster = som->winners[i];
+		td_add(&digests[0], som->distances[i]);
+		td_add(&digests[cluster + 1], som->distances[i]);
+	}
+	for (auto& digest : digests) td_flush(&digest);
+
+	std::vector<char> body(header.file_size - header.header_size, 0);
+	char* base = body.data() - header.header_size;
+	memcpy(base + header.weights_offset, som->weights.data, weight_bytes);
+	memcpy(base + header.stats_offset, som->cluster_stats.data, stats_bytes);
+	memcpy(base + header.digests_offset, digests.data(), digest_bytes);
+	if (projection_bytes) memcpy(base + header.projection_offset, proj_data(som->projection), projection_bytes);
+	header.checksum = ad_hash(body.data(), body.size());
+
+	char temporary_path [AD_PATH_SIZE + 8];
+	snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+	FILE* file = fopen(temporary_path, "wb");
+	if (!file) return AD_RETURN_BAD_FILE;
+
+	bool written = fwrite(&header, sizeof(ad_model_header), 1, file) == 1;
+	written &= fwrite(body.data(), body.size(), 1, file) == 1;
+	written &= fclose(file) == 0;
+	if (!written || !ad_replace_file(temporary_path, path)) return AD_RETURN_BAD_FILE;
+
+	return AD_RETURN_SUCCESS;
+}
+
+ad_return_t model_load(ad_model_t* model, const char* path) {
+	model->data = ad_map_file(path, &model->size);
+	if (!model->data) return AD_RETURN_BAD_FILE;
+
+	model->header = (ad_model_header*)model->data;
+	ad_model_header* header = model->header;
+	bool valid = model->size >= sizeof(ad_model_header);
+	valid = valid && header->file_magic == ad_model_header::magic;
+	valid = valid && header->file_version == ad_model_header::version;
+	valid = valid && header->header_size == sizeof(ad_model_header);
+	valid = valid && header->file_size == model->size;
+	valid = valid && header->weights_offset % AD_MODEL_ALIGNMENT == 0;
+	valid = valid && header->weights_offset + (uint64)header->clusters * header->cols * sizeof(float32) <= header->stats_offset;
+	valid = valid && header->stats_offset + header->clusters * sizeof(cluster_stats_t) <= model->size;
+	valid = valid && header->digests_offset + (header->clusters + 1) * sizeof(tdigest_t) <= model->size;
+	if (valid && header->projection != projection_kind::none) {
+		proj_view(&model->projection, header->projection, header->input_cols, header->cols, header->projection_nonzeros, (char*)model->data + header->projection_offset);
+		valid = header->projection_offset % AD_MODEL_ALIGNMENT == 0 && header->projection_offset + proj_bytes(&model->projection) <= model->size;
+	}
+	if (!valid) {
+		fprintf(stderr, "not a model file, or written by an incompatible version, path = %s\n", path);
+		model_free(model);
+		return AD_RETURN_BAD_HEADER;
+	}
+
+	char* base = (char*)model->data;
+	mtx_init(&model->weights, (float32*)(base + header->weights_offset), header->clusters, header->cols);
+	model->stats = (cluster_stats_t*)(base + header->stats_offset);
+	model->error_digest = (tdigest_t*)(base + header->digests_offset);
+	model->cluster_digests = model->error_digest + 1;
+
+	return AD_RETURN_SUCCESS;
+}
+
+bool model_verify(ad_model_t* model) {
+	char* body = (char*)model->data + model->header->header_size;
+	return ad_hash(body, model->size - model->header->header_size) == model->header->checksum;
+}
+
+void model_free(ad_model_t* model) {
+	if (model->data) ad_unmap_file(model->data, model->size);
+	model->data = nullptr;
+	model->size = 0;
+	model->header = nullptr;
+	model->stats = nullptr;
+	model->error_digest = nullptr;
+	model->cluster_digests = nullptr;
+	model->projection = projection_t();
+}
+
+void som_init(som_t* som, ad_model_t* model) {
+	som->config = model->header->config;
+	som->weights = model->weights;
+	som_select_kernels(som, model->weights.cols);
+
+	if (som->is_soa) {
+		soa_init(&som->soa_weights, som->weights.rows, som->weights.cols);
+		soa_from_mtx(som->soa_weights, som->weights);
+	}
+
+	if (model->projection.kind != projection_kind::none) som->projection = &model->projection;
+	// The index is built again on every load, so it's seeded from the model rather than from config.seed, which
+	// may be zero (random): the same model always scores the same way
+	if (som->config.pq_subspaces) som_pq_init(som, som->config.pq_subspaces, som->config.pq_shortlist, model->header->checksum);
+	else if (strlen(som->config.codebook)) som_codebook_init(som, !strcmp(som->config.codebook, "feature"), som->config.codebook_rerank);
+}
+
+ad_return_t model_warm_start(som_t* som, ad_model_t* model) {
+	ad_model_header* header = model->header;
+	// k-means doesn't care how the units were arranged, but a map does
+	if (som->engine == som_engine::som && header->topology != ad_topology::line) {
+		fprintf(stderr, "model units aren't on a line, which is the only topology maps train on\n");
+		return AD_RETURN_BAD_HEADER;
+	}
+	if (header->clusters != som->weights.rows || header->cols != som->weights.cols) {
+		fprintf(stderr, "model has %d units of %d features, but the map has %d units of %d features\n",
+				header->clusters, header->cols, som->weights.rows, som->weights.cols);
+		return AD_RETURN_BAD_HEADER;
+	}
+
+	// The weights only mean the same thing under the same metric, over inputs projected the same way
+	if (metric_from_name(header->config.metric) != som->metric) {
+		const char* model_metric = strlen(header->config.metric) ? header->config.metric : "l2sq";
+		const char* som_metric = strlen(som->config.metric) ? som->config.metric : "l2sq";
+		fprintf(stderr, "model was trained with metric = %s, but the map uses metric = %s\n", model_metric, som_metric);
+		return AD_RETURN_BAD_HEADER;
+	}
+	projection_t* projection = som->projection;
+	bool same_projection = header->projection == (projection ? projection->kind : projection_kind::none);
+	if (same_projection && projection) {
+		same_projection = header->input_cols == projection->input_cols && header->projection_nonzeros == projection->nonzeros;
+		same_projection = same_projection && !memcmp(proj_data(&model->projection), proj_data(projection), proj_bytes(projection));
+	}
+	if (!same_projection) {
+		fprintf(stderr, "model was trained on differently projected inputs than the map\n");
+		return AD_RETURN_BAD_HEADER;
+	}
+
+	som_warm_start(som, model->weights);
+
+	// k-means units carry on as the running means of what they won last time, so they don't jump to the
+	// first batch's
+	if (som->engine == som_engine::kmeans) {
+		for (uint32 cluster = 0; cluster < header->clusters; cluster++) som->unit_counts.data[cluster] = model->stats[cluster].hits;
+	}
+	return AD_RETURN_SUCCESS;
+}
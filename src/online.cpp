@@ -0,0 +1,165 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <float.h>
+
+#include "online.hpp"
+
+// Train a new map on rows (which it takes over), starting from the weights of the previous one if there is one
+online_model_t* online_train(online_trainer_t* trainer, std::vector<float32>& rows, online_model_t* previous) {
+	online_model_t* model = new online_model_t();
+	model->inputs.swap(rows);
+	model->version = previous ? previous->version + 1 : 1;
+
+	som_t* som = &model->som;
+	som->config = trainer->config;
+	som_init(som, model->inputs.data(), model->inputs.size() / trainer->cols, trainer->cols);
+
+	// The window mostly holds the same rows as last time, so the last map is already close
+	if (previous) som_warm_start(som, previous->som.weights);
+
+	// Same stopping rule as ad_train, plus the epoch cap, and stop once the learning rate has decayed to
+	// nothing, since no further epoch can change anything
+	float32 last_error = FLT_MAX;
+	uint32 max_epochs = trainer->config.retrain_epochs;
+	for (uint32 epoch = 0; !max_epochs || epoch < max_epochs; epoch++) {
+		som_epoch_t result = som_iterate(som);
+		bool decayed = !decayed_learning_rate(som);
+		apply_deltas(som);
+
+		float32 delta_error = fabs(result.quantization_error - last_error);
+		last_error = result.quantization_error;
+		if (delta_error < som->config.error_threshold || decayed) break;
+	}
+
+	return model;
+}
+
+void online_free(online_model_t* model) {
+	som_free(&model->som);
+	delete model;
+}
+
+// Free every retired map that no reader has announced. A reader that loaded a retired map after it was
+// swapped out sees that it's no longer current and retries, so it never goes on to use it.
+void online_reclaim(online_trainer_t* trainer) {
+	uint32 kept = 0;
+	for (online_model_t* model : trainer->retired) {
+		bool in_use = false;
+		for (auto& hazard : trainer->hazards) in_use |= hazard.load() == model;
+
+		if (in_use) trainer->retired[kept++] = model;
+		else online_free(model);
+	}
+	trainer->retired.resize(kept);
+}
+
+void online_run(online_trainer_t* trainer) {
+	uint32 cols = trainer->cols;
+	uint32 window_rows = trainer->config.window_rows;
+	uint32 interval = trainer->config.retrain_interval ? trainer->config.retrain_interval : window_rows;
+
+	std::vector<float32> rows;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(trainer->window_lock);
+			trainer->window_changed.wait(lock, [&]() { return trainer->stopping || trainer->pending >= interval; });
+			if (trainer->stopping) return;
+
+			// Copy the window out oldest row first, so training doesn't hold up pushes
+			uint32 oldest = trainer->filled < window_rows ? 0 : trainer->next;
+			rows.resize(trainer->filled * cols);
+			for (uint32 i = 0; i < trainer->filled; i++) {
+				uint32 row = (oldest + i) % window_rows;
+				memcpy(rows.data() + i * cols, trainer->window.data() + row * cols, cols * sizeof(float32));
+			}
+			trainer->pending = 0;
+		}
+
+		// Only this thread writes current, so it can read it without announcing it
+		online_model_t* previous = trainer->current.load();
+		online_model_t* model = online_train(trainer, rows, previous);
+		trainer->current.store(model);
+
+		if (previous) trainer->retired.push_back(previous);
+		online_reclaim(trainer);
+	}
+}
+
+void online_start(online_trainer_t* trainer, config_t* config, uint32 cols) {
+	trainer->config = *config;
+	trainer->cols = cols;
+	if (!trainer->config.window_rows) {
+		fprintf(stderr, "window_rows isn't set, keeping the last %d rows\n", trainer->config.count_clusters * 64);
+		trainer->config.window_rows = trainer->config.count_clusters * 64;
+	}
+
+	trainer->window.resize(trainer->config.window_rows * cols);
+	trainer->thread = std::thread(online_run, trainer);
+}
+
+void online_push(online_trainer_t* trainer, float32* rows, uint32 count) {
+	uint32 cols = trainer->cols;
+	uint32 window_rows = trainer->config.window_rows;
+	{
+		std::lock_guard<std::mutex> lock(trainer->window_lock);
+		for (uint32 i = 0; i < count; i++) {
+			memcpy(trainer->window.data() + trainer->next * cols, rows + i * cols, cols * sizeof(float32));
+			trainer->next = (trainer->next + 1) % window_rows;
+			if (trainer->filled < window_rows) trainer->filled++;
+		}
+		trainer->pending += count;
+	}
+	trainer->window_changed.notify_one();
+}
+
+// Stop the trainer and free every map. Readers have to be done by now.
+void online_stop(online_trainer_t* trainer) {
+	{
+		std::lock_guard<std::mutex> lock(trainer->window_lock);
+		trainer->stopping = true;
+	}
+	trainer->window_changed.notify_one();
+	if (trainer->thread.joinable()) trainer->thread.join();
+
+	for (online_model_t* model : trainer->retired) online_free(model);
+	trainer->retired.clear();
+	if (trainer->current.load()) online_free(trainer->current.exchange(nullptr));
+}
+
+uint32 online_reader(online_trainer_t* trainer) {
+	uint32 reader = trainer->readers++;
+	if (reader >= AD_ONLINE_READERS) {
+		fprintf(stderr, "more than %d readers, which would let maps be freed while in use\n", AD_ONLINE_READERS);
+		exit(1);
+	}
+	return reader;
+}
+
+// Announce the current map, then make sure it's still current. If it is, the trainer either hadn't retired it
+// yet when it checked the hazards, or saw the announcement, and won't free it until it's released.
+online_model_t* online_acquire(online_trainer_t* trainer, uint32 reader) {
+	online_model_t* model = trainer->current.load();
+	while (true) {
+		trainer->hazards[reader].store(model);
+		online_model_t* check = trainer->current.load();
+		if (check == model) return model;
+		model = check;
+	}
+}
+
+void online_release(online_trainer_t* trainer, uint32 reader) {
+	trainer->hazards[reader].store(nullptr);
+}
+
+uint64 online_predict(online_trainer_t* trainer, uint32 reader, matrix_t& rows, uint32* winners, float32* scores) {
+	online_model_t* model = online_acquire(trainer, reader);
+	uint64 version = 0;
+	if (model) {
+		som_predict(&model->som, rows, winners, scores, 1);
+		version = model->version;
+	}
+	online_release(trainer, reader);
+	return version;
+}
@@ -85,6 +85,67 @@ void init_paths() {
 #endif
 
 
+#ifdef _WIN32
+bool ad_replace_file(const char* from, const char* to) {
+	HANDLE file = CreateFileA(from, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	bool flushed = FlushFileBuffers(file);
+	CloseHandle(file);
+	return flushed && MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+}
+
+void* ad_map_file(const char* path, uint64* size) {
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return nullptr;
+
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	*size = file_size.QuadPart;
+
+	// The view keeps the mapping alive, so neither handle is needed once it exists
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (mapping) CloseHandle(mapping);
+	CloseHandle(file);
+	return data;
+}
+
+void ad_unmap_file(void* data, uint64 size) {
+	UnmapViewOfFile(data);
+}
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool ad_replace_file(const char* from, const char* to) {
+	int file = open(from, O_WRONLY);
+	if (file < 0) return false;
+	bool synced = !fsync(file);
+	synced &= !close(file);
+	return synced && !rename(from, to);
+}
+
+void* ad_map_file(const char* path, uint64* size) {
+	int file = open(path, O_RDONLY);
+	if (file < 0) return nullptr;
+
+	struct stat info;
+	if (fstat(file, &info) || !info.st_size) { close(file); return nullptr; }
+	*size = info.st_size;
+
+	void* data = mmap(nullptr, *size, PROT_READ, MAP_SHARED, file, 0);
+	close(file);
+	return data == MAP_FAILED ? nullptr : data;
+}
+
+void ad_unmap_file(void* data, uint64 size) {
+	munmap(data, size);
+}
+#endif
+
+
 // This has to be after everything is defined...?
 void fill_path_templates() {
 	snprintf(paths::ad_build,              256, _ad_build,              paths::ad_project_root);
@@ -0,0 +1,287 @@
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <float.h>
+#include <vector>
+#include <algorithm>
+#include <bit>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "pq.hpp"
+#include "kernels.hpp"
+#include "random.hpp"
+#include "utils.hpp"
+
+float32 pq_distance(const float32* a, const float32* b, uint32 width) {
+	float32 sum = 0;
+	for (uint32 i = 0; i < width; i++) sum += (a[i] - b[i]) * (a[i] - b[i]);
+	return sum;
+}
+
+uint32 pq_nearest(const float32* centroids, const float32* x, uint32 width) {
+	uint32 nearest = 0;
+	float32 min_distance = FLT_MAX;
+	for (uint32 k = 0; k < AD_PQ_CENTROIDS; k++) {
+		float32 d = pq_distance(centroids + k * width, x, width);
+		if (d < min_distance) {
+			nearest = k;
+			min_distance = d;
+		}
+	}
+	return nearest;
+}
+
+// Lloyd's k-means over one subspace of every unit, starting from distinct units picked at random. With fewer
+// units than centroids, every unit gets a centroid of its own and the spare ones repeat the first.
+void pq_cluster(float32* points, uint32 rows, uint32 width, float32* centroids, rng_t* rng) {
+	uint32 k = rows < AD_PQ_CENTROIDS ? rows : AD_PQ_CENTROIDS;
+	std::vector<uint32> order(rows);
+	for (uint32 i = 0; i < rows; i++) order[i] = i;
+	for (uint32 i = 0; i < k; i++) {
+		uint32 j = i + rng_below(rng, rows - i);
+		std::swap(order[i], order[j]);
+		memcpy(centroids + i * width, points + order[i] * width, width * sizeof(float32));
+	}
+	for (uint32 i = k; i < AD_PQ_CENTROIDS; i++) memcpy(centroids + i * width, centroids, width * sizeof(float32));
+	if (k < AD_PQ_CENTROIDS) return;
+
+	std::vector<float32> sums(AD_PQ_CENTROIDS * width);
+	std::vector<uint32> counts(AD_PQ_CENTROIDS);
+	for (uint32 iteration = 0; iteration < AD_PQ_ITERATIONS; iteration++) {
+		std::fill(sums.begin(), sums.end(), 0.f);
+		std::fill(counts.begin(), counts.end(), 0);
+		for (uint32 row = 0; row < rows; row++) {
+			float32* x = points + row * width;
+			uint32 nearest = pq_nearest(centroids, x, width);
+			for (uint32 i = 0; i < width; i++) sums[nearest * width + i] += x[i];
+			counts[nearest]++;
+		}
+
+		// A centroid nothing was assigned to stays where it was
+		for (uint32 c = 0; c < AD_PQ_CENTROIDS; c++) {
+			if (!counts[c]) continue;
+			for (uint32 i = 0; i < width; i++) centroids[c * width + i] = sums[c * width + i] / counts[c];
+		}
+	}
+}
+
+void pq_init(pq_index_t* pq, matrix_t& weights, uint32 subspaces, uint32 shortlist, uint64 seed) {
+	if (!subspaces) subspaces = 1;
+	if (subspaces > weights.cols) subspaces = weights.cols;
+	if (subspaces > AD_PQ_MAX_SUBSPACES) subspaces = AD_PQ_MAX_SUBSPACES;
+
+	pq->rows = weights.rows;
+	pq->cols = weights.cols;
+	pq->width = (weights.cols + subspaces - 1) / subspaces;
+	pq->subspaces = (weights.cols + pq->width - 1) / pq->width;
+	pq->subspaces += pq->subspaces % 2;
+	pq->shortlist = shortlist ? shortlist : AD_PQ_SHORTLIST;
+	if (pq->shortlist > AD_PQ_MAX_SHORTLIST) pq->shortlist = AD_PQ_MAX_SHORTLIST;
+	pq->blocks = (weights.rows + AD_PQ_BLOCK - 1) / AD_PQ_BLOCK;
+
+	uint64 codes_size = (uint64)pq->blocks * (pq->subspaces / 2) * AD_PQ_BLOCK;
+	pq->centroids = (float32*)calloc(pq->subspaces * AD_PQ_CENTROIDS * pq->width, sizeof(float32));
+	pq->codes = (uint8*)ad_aligned_alloc(codes_size, AD_PQ_BLOCK);
+	memset(pq->codes, 0, codes_size);
+
+	rng_t rng;
+	rng_seed(&rng, seed);
+	uint32 width = pq->width;
+	std::vector<float32> points(weights.rows * width);
+	std::vector<float32> centroids(AD_PQ_CENTROIDS * width);
+	for (uint32 m = 0; m < pq->subspaces; m++) {
+		// Gather this subspace of every unit, zero padded past the last feature
+		uint32 begin = m * width;
+		uint32 end = begin + width < weights.cols ? begin + width : weights.cols;
+		std::fill(points.begin(), points.end(), 0.f);
+		for (uint32 row = 0; row < weights.rows; row++) {
+			if (begin < end) memcpy(points.data() + row * width, mtx_at(weights, row, begin), (end - begin) * sizeof(float32));
+		}
+
+		pq_cluster(points.data(), weights.rows, width, centroids.data(), &rng);
+
+		uint32 shift = (m % 2) * 4;
+		for (uint32 row = 0; row < weights.rows; row++) {
+			uint64 offset = ((uint64)(row / AD_PQ_BLOCK) * (pq->subspaces / 2) + m / 2) * AD_PQ_BLOCK + row % AD_PQ_BLOCK;
+			pq->codes[offset] |= pq_nearest(centroids.data(), points.data() + row * width, width) << shift;
+		}
+
+		float32* transposed = pq->centroids + m * width * AD_PQ_CENTROIDS;
+		for (uint32 k = 0; k < AD_PQ_CENTROIDS; k++) {
+			for (uint32 i = 0; i < width; i++) transposed[i * AD_PQ_CENTROIDS + k] = centroids[k * width + i];
+		}
+	}
+}
+
+void pq_free(pq_index_t* pq) {
+	free(pq->centroids);
+	ad_aligned_free(pq->codes);
+	pq->centroids = nullptr;
+	pq->codes = nullptr;
+}
+
+uint64 pq_bytes(pq_index_t* pq) {
+	return (uint64)pq->subspaces * AD_PQ_CENTROIDS * pq->width * sizeof(float32) + (uint64)pq->blocks * (pq->subspaces / 2) * AD_PQ_BLOCK;
+}
+
+// The query's distance to every centroid, as bytes. Each subspace's smallest distance is subtracted first,
+// which shifts every unit's estimate by the same amount, and then one scale maps the widest remaining range to
+// 255. Sums of up to AD_PQ_MAX_SUBSPACES entries fit in 16 bits.
+void pq_tables(pq_index_t* pq, vector_t& input, uint8* tables) {
+	uint32 width = pq->width;
+	float32 distances [AD_PQ_MAX_SUBSPACES * AD_PQ_CENTROIDS];
+	float32 range = 0;
+	for (uint32 m = 0; m < pq->subspaces; m++) {
+		// The centroids are zero past the last feature, like the units they came from, so the padding adds nothing
+		uint32 begin = m * width < pq->cols ? m * width : pq->cols;
+		uint32 end = begin + width < pq->cols ? begin + width : pq->cols;
+
+		// Feature by feature, across all the centroids at once, which vectorizes without reordering any sums
+		const float32* centroids = pq->centroids + m * width * AD_PQ_CENTROIDS;
+		float32 sums [AD_PQ_CENTROIDS] = { 0 };
+		for (uint32 i = begin; i < end; i++, centroids += AD_PQ_CENTROIDS) {
+			float32 x = input[i];
+			for (uint32 k = 0; k < AD_PQ_CENTROIDS; k++) sums[k] += (x - centroids[k]) * (x - centroids[k]);
+		}
+
+		float32 min_distance = sums[0];
+		for (uint32 k = 1; k < AD_PQ_CENTROIDS; k++) min_distance = sums[k] < min_distance ? sums[k] : min_distance;
+
+		float32* d = distances + m * AD_PQ_CENTROIDS;
+		for (uint32 k = 0; k < AD_PQ_CENTROIDS; k++) {
+			d[k] = sums[k] - min_distance;
+			range = d[k] > range ? d[k] : range;
+		}
+	}
+
+	// Plain compares and conversions rather than fmin, so the loop vectorizes
+	float32 scale = range ? 255 / range : 0;
+	uint32 count = pq->subspaces * AD_PQ_CENTROIDS;
+	for (uint32 i = 0; i < count; i++) {
+		float32 q = distances[i] * scale + .5f;
+		tables[i] = (uint8)(int32)(q < 255 ? q : 255);
+	}
+}
+
+// The shortlist is a max-heap on the estimate, so the worst candidate is always at the root, where a better one
+// replaces it
+inline void pq_shortlist_add(uint32* candidates, uint16* estimates, uint32* count, uint32 keep, uint32 unit, uint16 estimate) {
+	uint32 i;
+	if (*count < keep) {
+		// Sift the new candidate up from the end
+		for (i = (*count)++; i > 0 && estimates[(i - 1) / 2] < estimate; i = (i - 1) / 2) {
+			candidates[i] = candidates[(i - 1) / 2];
+			estimates[i] = estimates[(i - 1) / 2];
+		}
+	}
+	else {
+		if (estimate >= estimates[0]) return;
+
+		// Sift it down from the root, in place of the worst
+		for (i = 0; 2 * i + 1 < keep;) {
+			uint32 child = 2 * i + 1;
+			if (child + 1 < keep && estimates[child + 1] > estimates[child]) child++;
+			if (estimates[child] <= estimate) break;
+			candidates[i] = candidates[child];
+			estimates[i] = estimates[child];
+			i = child;
+		}
+	}
+	candidates[i] = unit;
+	estimates[i] = estimate;
+}
+
+void pq_find_bmu(som_t* som, vector_t& input, bmu_t* bmu) {
+	pq_index_t* pq = som->pq;
+	uint32 pairs = pq->subspaces / 2;
+	uint32 keep = pq->shortlist < pq->rows ? pq->shortlist : pq->rows;
+
+	alignas(32) uint8 tables [AD_PQ_MAX_SUBSPACES * AD_PQ_CENTROIDS];
+	pq_tables(pq, input, tables);
+
+	uint32 candidates [AD_PQ_MAX_SHORTLIST];
+	uint16 estimates [AD_PQ_MAX_SHORTLIST];
+	uint32 count = 0;
+
+	for (uint32 block = 0; block < pq->blocks; block++) {
+		const uint8* codes = pq->codes + (uint64)block * pairs * AD_PQ_BLOCK;
+		alignas(32) uint16 sums [AD_PQ_BLOCK];
+
+#if defined(__AVX2__)
+		// Each byte holds two codes, which index the two subspaces' tables: the shuffles look up all 32 units'
+		// entries at once. The entries are widened to 16 bits before they're added, which splits each lane's
+		// units across the two accumulators; the permutes at the end put them back in order.
+		__m256i nibble = _mm256_set1_epi8(0x0F);
+		__m256i zero = _mm256_setzero_si256();
+		__m256i low = zero;
+		__m256i high = zero;
+		for (uint32 pair = 0; pair < pairs; pair++) {
+			__m256i c = _mm256_load_si256((const __m256i*)(codes + pair * AD_PQ_BLOCK));
+			__m256i even = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)(tables + pair * 2 * AD_PQ_CENTROIDS)));
+			__m256i odd = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)(tables + (pair * 2 + 1) * AD_PQ_CENTROIDS)));
+			__m256i a = _mm256_shuffle_epi8(even, _mm256_and_si256(c, nibble));
+			__m256i b = _mm256_shuffle_epi8(odd, _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble));
+			low = _mm256_add_epi16(low, _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero)));
+			high = _mm256_add_epi16(high, _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero)));
+		}
+		__m256i first = _mm256_permute2x128_si256(low, high, 0x20);
+		__m256i second = _mm256_permute2x128_si256(low, high, 0x31);
+
+		// Most blocks have nothing better than the shortlist's worst, and are skipped with one compare; otherwise
+		// only the units that are better are offered to the shortlist
+		uint32 units = pq->rows - block * AD_PQ_BLOCK < AD_PQ_BLOCK ? pq->rows - block * AD_PQ_BLOCK : AD_PQ_BLOCK;
+		uint32 lanes = units < 32 ? (1u << units) - 1 : 0xFFFFFFFF;
+		if (count == keep) {
+			if (!estimates[0]) break;
+			__m256i limit = _mm256_set1_epi16((int16)(estimates[0] - 1));
+			__m256i better = _mm256_packs_epi16(_mm256_cmpeq_epi16(_mm256_min_epu16(first, limit), first),
+												_mm256_cmpeq_epi16(_mm256_min_epu16(second, limit), second));
+			lanes &= (uint32)_mm256_movemask_epi8(_mm256_permute4x64_epi64(better, _MM_SHUFFLE(3, 1, 2, 0)));
+			if (!lanes) continue;
+		}
+		_mm256_store_si256((__m256i*)sums, first);
+		_mm256_store_si256((__m256i*)(sums + 16), second);
+#else
+		memset(sums, 0, sizeof(sums));
+		for (uint32 pair = 0; pair < pairs; pair++) {
+			const uint8* c = codes + pair * AD_PQ_BLOCK;
+			const uint8* even = tables + pair * 2 * AD_PQ_CENTROIDS;
+			const uint8* odd = even + AD_PQ_CENTROIDS;
+			for (uint32 lane = 0; lane < AD_PQ_BLOCK; lane++) sums[lane] += even[c[lane] & 0x0F] + odd[c[lane] >> 4];
+		}
+
+		uint32 units = pq->rows - block * AD_PQ_BLOCK < AD_PQ_BLOCK ? pq->rows - block * AD_PQ_BLOCK : AD_PQ_BLOCK;
+		uint32 lanes = units < 32 ? (1u << units) - 1 : 0xFFFFFFFF;
+#endif
+
+		for (; lanes; lanes &= lanes - 1) {
+			uint32 lane = std::countr_zero(lanes);
+			pq_shortlist_add(candidates, estimates, &count, keep, block * AD_PQ_BLOCK + lane, sums[lane]);
+		}
+	}
+
+	// Rerank the shortlist exactly, with the SOM's metric
+	float32 second_distance;
+	bmu_init(bmu, &second_distance);
+	for (uint32 i = 0; i < count; i++) {
+		float32* weight = som->weights.data + (uint64)candidates[i] * som->weights.cols;
+		bmu_update(bmu, &second_distance, candidates[i], som->kernels.distance_bounded(som, input.data, weight, second_distance));
+	}
+}
+
+void som_pq_init(som_t* som, uint32 subspaces, uint32 shortlist, uint64 seed) {
+	som->pq = new pq_index_t();
+	som->pq->dense_find_bmu = som->kernels.find_bmu;
+	pq_init(som->pq, som->weights, subspaces, shortlist, seed);
+	som->kernels.find_bmu = &pq_find_bmu;
+}
+
+void som_pq_free(som_t* som) {
+	if (!som->pq) return;
+	som->kernels.find_bmu = som->pq->dense_find_bmu;
+	pq_free(som->pq);
+	delete som->pq;
+	som->pq = nullptr;
+}
@@ -0,0 +1,316 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <float.h>
+#include <vector>
+#include <algorithm>
+
+#include "projection.hpp"
+#include "utils.hpp"
+
+// Call f(feature, value) for each nonzero feature of a row, whichever way the rows are stored
+template<typename F>
+void proj_each(matrix_t& rows, uint32 row, F&& f) {
+	float32* x = mtx_at(rows, row, 0);
+	for (uint32 i = 0; i < rows.cols; i++) if (x[i]) f(i, x[i]);
+}
+
+template<typename F>
+void proj_each(sparse_matrix_t& rows, uint32 row, F&& f) {
+	sparse_vector_t x = spm_at(rows, row);
+	spv_for(x, n) f(x.indices[n], x.values[n]);
+}
+
+// Modified Gram-Schmidt over the columns of a rows x cols matrix stored row-major
+void proj_orthonormalize(float64* a, uint32 rows, uint32 cols) {
+	for (uint32 j = 0; j < cols; j++) {
+		for (uint32 p = 0; p < j; p++) {
+			float64 dot = 0;
+			for (uint32 i = 0; i < rows; i++) dot += a[i * cols + j] * a[i * cols + p];
+			for (uint32 i = 0; i < rows; i++) a[i * cols + j] -= dot * a[i * cols + p];
+		}
+
+		float64 norm = 0;
+		for (uint32 i = 0; i < rows; i++) norm += a[i * cols + j] * a[i * cols + j];
+		norm = norm > 0 ? 1 / sqrt(norm) : 0;
+		for (uint32 i = 0; i < rows; i++) a[i * cols + j] *= norm;
+	}
+}
+
+// Eigen decomposition of the symmetric n x n matrix a by cyclic Jacobi rotations, which is plenty for the
+// small matrices the sketch leaves. a is overwritten. Eigenvalues come back in descending order, with their
+// eigenvectors as the columns of vectors.
+void proj_eigen(float64* a, uint32 n, float64* values, float64* vectors) {
+	std::vector<float64> v(n * n, 0);
+	for (uint32 i = 0; i < n; i++) v[i * n + i] = 1;
+
+	for (uint32 sweep = 0; sweep < 64; sweep++) {
+		float64 off = 0, diagonal = 0;
+		for (uint32 p = 0; p < n; p++) {
+			diagonal += a[p * n + p] * a[p * n + p];
+			for (uint32 q = p + 1; q < n; q++) off += a[p * n + q] * a[p * n + q];
+		}
+		if (off <= DBL_EPSILON * DBL_EPSILON * diagonal) break;
+
+		for (uint32 p = 0; p < n; p++) {
+			for (uint32 q = p + 1; q < n; q++) {
+				float64 apq = a[p * n + q];
+				if (!apq) continue;
+
+				float64 theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+				float64 t = (theta < 0 ? -1 : 1) / (fabs(theta) + sqrt(theta * theta + 1));
+				float64 c = 1 / sqrt(t * t + 1);
+				float64 s = t * c;
+
+				for (uint32 r = 0; r < n; r++) {
+					float64 arp = a[r * n + p], arq = a[r * n + q];
+					a[r * n + p] = c * arp - s * arq;
+					a[r * n + q] = s * arp + c * arq;
+				}
+				for (uint32 r = 0; r < n; r++) {
+					float64 apr = a[p * n + r], aqr = a[q * n + r];
+					a[p * n + r] = c * apr - s * aqr;
+					a[q * n + r] = s * apr + c * aqr;
+				}
+				for (uint32 r = 0; r < n; r++) {
+					float64 vrp = v[r * n + p], vrq = v[r * n + q];
+					v[r * n + p] = c * vrp - s * vrq;
+					v[r * n + q] = s * vrp + c * vrq;
+				}
+			}
+		}
+	}
+
+	std::vector<uint32> order(n);
+	for (uint32 i = 0; i < n; i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&](uint32 x, uint32 y) { return a[x * n + x] > a[y * n + y]; });
+	for (uint32 j = 0; j < n; j++) {
+		values[j] = a[order[j] * n + order[j]];
+		for (uint32 i = 0; i < n; i++) vectors[i * n + j] = v[i * n + order[j]];
+	}
+}
+
+// Each input feature goes to nonzeros distinct output features, each with its own random sign
+void proj_init_random(projection_t* projection, rng_t* rng) {
+	uint32 s = projection->nonzeros;
+	projection->indices = (uint32*)calloc((uint64)projection->input_cols * s, sizeof(uint32));
+	for (uint32 i = 0; i < projection->input_cols; i++) {
+		uint32* indices = projection->indices + (uint64)i * s;
+		for (uint32 t = 0; t < s; t++) {
+			uint32 index;
+			bool taken = true;
+			while (taken) {
+				index = rng_below(rng, projection->output_cols);
+				taken = false;
+				for (uint32 u = 0; u < t; u++) taken |= (indices[u] & ~AD_PROJECTION_SIGN) == index;
+			}
+			indices[t] = index | (rng_next(rng) & 1 ? AD_PROJECTION_SIGN : 0);
+		}
+	}
+}
+
+// Streaming PCA by a randomized Nystrom sketch (Tropp et al., "Fixed-rank approximation of a positive-
+// semidefinite matrix from streaming data"). The rows' second moment C = sum x x^T is never formed: one pass
+// over the rows accumulates only S = C Omega, for a random orthonormal test matrix Omega with a few more
+// columns than components wanted. Then, all in the sketch's small dimension:
+// - shift S by a tiny multiple of Omega, so the core matrix B = Omega^T S is safely positive definite
+// - F = S B^(-1/2), so that C is approximated by F F^T
+// - the left singular vectors of F, from the eigen decomposition of F^T F, are the components
+// Each thread sketches its own slice of the rows, costing two passes over each row's nonzeros per sketch
+// column, and the threads' sketches are summed at the end.
+template<typename M>
+void proj_fit_pca(projection_t* projection, M& rows, uint32 count, uint32 threads, rng_t* rng) {
+	uint32 d = projection->input_cols;
+	uint32 k = projection->output_cols;
+	uint32 l = k + AD_PROJECTION_OVERSAMPLING < d ? k + AD_PROJECTION_OVERSAMPLING : d;
+
+	std::vector<float64> omega((uint64)d * l);
+	for (auto& x : omega) x = 2 * rng_float32(rng) - 1;
+	proj_orthonormalize(omega.data(), d, l);
+
+	if (threads > count) threads = count ? count : 1;
+	std::vector<float64> sketches((uint64)threads * d * l, 0);
+	std::vector<float64> lengths(threads, 0);
+	ad_parallel_for(count, threads, [&](uint32 begin, uint32 end, uint32 thread) {
+		float64* sketch = sketches.data() + (uint64)thread * d * l;
+		std::vector<float64> t(l);
+		float64 length = 0;
+		for (uint32 row = begin; row < end; row++) {
+			std::fill(t.begin(), t.end(), 0);
+			proj_each(rows, row, [&](uint32 i, float32 x) {
+				const float64* o = omega.data() + (uint64)i * l;
+				for (uint32 j = 0; j < l; j++) t[j] += x * o[j];
+				length += x * x;
+			});
+			proj_each(rows, row, [&](uint32 i, float32 x) {
+				float64* s = sketch + (uint64)i * l;
+				for (uint32 j = 0; j < l; j++) s[j] += x * t[j];
+			});
+		}
+		lengths[thread] = length;
+	});
+
+	float64* sketch = sketches.data();
+	for (uint32 thread = 1; thread < threads; thread++) {
+		float64* other = sketches.data() + (uint64)thread * d * l;
+		for (uint64 i = 0; i < (uint64)d * l; i++) sketch[i] += other[i];
+		lengths[0] += lengths[thread];
+	}
+
+	float64 norm = 0;
+	for (uint64 i = 0; i < (uint64)d * l; i++) norm += sketch[i] * sketch[i];
+	float64 shift = sqrt((float64)d) * DBL_EPSILON * sqrt(norm);
+	for (uint64 i = 0; i < (uint64)d * l; i++) sketch[i] += shift * omega[i];
+
+	std::vector<float64> core(l * l, 0);
+	for (uint32 i = 0; i < d; i++) {
+		for (uint32 p = 0; p < l; p++) {
+			for (uint32 q = 0; q < l; q++) core[p * l + q] += omega[(uint64)i * l + p] * sketch[(uint64)i * l + q];
+		}
+	}
+	for (uint32 p = 0; p < l; p++) {
+		for (uint32 q = p + 1; q < l; q++) core[p * l + q] = core[q * l + p] = (core[p * l + q] + core[q * l + p]) / 2;
+	}
+
+	// B^(-1/2), leaving out directions the data doesn't reach at all
+	std::vector<float64> values(l), vectors(l * l), root(l * l, 0);
+	proj_eigen(core.data(), l, values.data(), vectors.data());
+	for (uint32 m = 0; m < l; m++) {
+		if (values[m] <= values[0] * 1e-12) continue;
+		float64 scale = 1 / sqrt(values[m]);
+		for (uint32 p = 0; p < l; p++) {
+			for (uint32 q = 0; q < l; q++) root[p * l + q] += vectors[p * l + m] * scale * vectors[q * l + m];
+		}
+	}
+
+	std::vector<float64> f((uint64)d * l, 0);
+	for (uint32 i = 0; i < d; i++) {
+		for (uint32 p = 0; p < l; p++) {
+			float64 s = sketch[(uint64)i * l + p];
+			for (uint32 q = 0; q < l; q++) f[(uint64)i * l + q] += s * root[p * l + q];
+		}
+	}
+
+	std::vector<float64> gram(l * l, 0);
+	for (uint32 i = 0; i < d; i++) {
+		for (uint32 p = 0; p < l; p++) {
+			for (uint32 q = 0; q < l; q++) gram[p * l + q] += f[(uint64)i * l + p] * f[(uint64)i * l + q];
+		}
+	}
+	proj_eigen(gram.data(), l, values.data(), vectors.data());
+
+	projection->components = (float32*)calloc((uint64)d * k, sizeof(float32));
+	float64 kept = 0;
+	for (uint32 j = 0; j < k; j++) {
+		if (values[j] <= values[0] * 1e-12) continue;
+		kept += values[j] - shift > 0 ? values[j] - shift : 0;
+
+		float64 scale = 1 / sqrt(values[j]);
+		for (uint32 i = 0; i < d; i++) {
+			float64 u = 0;
+			for (uint32 q = 0; q < l; q++) u += f[(uint64)i * l + q] * vectors[q * l + j];
+			projection->components[(uint64)i * k + j] = (float32)(u * scale);
+		}
+	}
+	projection->explained = lengths[0] > 0 ? (float32)(kept / lengths[0]) : 0;
+}
+
+// Fill in everything but the projection itself. Only a reduction that leaves fewer features than the
+// inputs have is worth doing.
+bool proj_init(projection_t* projection, config_t* config, uint32 input_cols) {
+	*projection = projection_t();
+	uint32 k = config->reduced_dimensions;
+	if (!strcmp(config->reduction, "random")) projection->kind = projection_kind::random;
+	else if (!strcmp(config->reduction, "pca")) projection->kind = projection_kind::pca;
+	else return false;
+
+	if (!k || k >= input_cols) {
+		fprintf(stderr, "reduced_dimensions = %d doesn't reduce %d features, so inputs won't be reduced\n", k, input_cols);
+		projection->kind = projection_kind::none;
+		return false;
+	}
+
+	projection->input_cols = input_cols;
+	projection->output_cols = k;
+	projection->owned = true;
+	if (projection->kind == projection_kind::random) projection->nonzeros = AD_PROJECTION_NONZEROS < k ? AD_PROJECTION_NONZEROS : k;
+	return true;
+}
+
+template<typename M>
+bool proj_fit_any(projection_t* projection, config_t* config, M& rows, uint32 cols, uint32 count, uint32 threads) {
+	if (!proj_init(projection, config, cols)) return false;
+
+	rng_t rng;
+	rng_seed(&rng, config->seed);
+	if (projection->kind == projection_kind::random) proj_init_random(projection, &rng);
+	else proj_fit_pca(projection, rows, count, threads ? threads : 1, &rng);
+	return true;
+}
+
+bool proj_fit(projection_t* projection, config_t* config, matrix_t& rows, uint32 threads) {
+	return proj_fit_any(projection, config, rows, rows.cols, rows.rows, threads);
+}
+
+bool proj_fit(projection_t* projection, config_t* config, sparse_matrix_t& rows, uint32 threads) {
+	return proj_fit_any(projection, config, rows, rows.cols, rows.rows, threads);
+}
+
+void proj_rows(projection_t* projection, matrix_t& rows, float32* output, uint32 threads) {
+	ad_parallel_for(rows.rows, threads ? threads : 1, [&](uint32 begin, uint32 end, uint32) {
+		for (uint32 row = begin; row < end; row++) proj_apply(projection, mtx_at(rows, row, 0), output + (uint64)row * projection->output_cols);
+	});
+}
+
+void proj_rows(projection_t* projection, sparse_matrix_t& rows, float32* output, uint32 threads) {
+	ad_parallel_for(rows.rows, threads ? threads : 1, [&](uint32 begin, uint32 end, uint32) {
+		for (uint32 row = begin; row < end; row++) {
+			sparse_vector_t input = spm_at(rows, row);
+			proj_apply(projection, input, output + (uint64)row * projection->output_cols);
+		}
+	});
+}
+
+// An owned copy, for keeping a loaded model's projection after the model is unmapped
+void proj_copy(projection_t* projection, projection_t* from) {
+	*projection = *from;
+	projection->owned = true;
+	projection->indices = nullptr;
+	projection->components = nullptr;
+
+	uint64 bytes = proj_bytes(from);
+	void* data = malloc(bytes);
+	memcpy(data, proj_data(from), bytes);
+	if (from->kind == projection_kind::random) projection->indices = (uint32*)data;
+	if (from->kind == projection_kind::pca) projection->components = (float32*)data;
+}
+
+void proj_free(projection_t* projection) {
+	if (projection->owned) {
+		free(projection->indices);
+		free(projection->components);
+	}
+	*projection = projection_t();
+}
+
+uint64 proj_bytes(projection_t* projection) {
+	if (projection->kind == projection_kind::random) return (uint64)projection->input_cols * projection->nonzeros * sizeof(uint32);
+	if (projection->kind == projection_kind::pca) return (uint64)projection->input_cols * projection->output_cols * sizeof(float32);
+	return 0;
+}
+
+const void* proj_data(projection_t* projection) {
+	if (projection->kind == projection_kind::random) return projection->indices;
+	return projection->components;
+}
+
+void proj_view(projection_t* projection, projection_kind kind, uint32 input_cols, uint32 output_cols, uint32 nonzeros, void* data) {
+	*projection = projection_t();
+	projection->kind = kind;
+	projection->input_cols = input_cols;
+	projection->output_cols = output_cols;
+	projection->nonzeros = nonzeros;
+	if (kind == projection_kind::random) projection->indices = (uint32*)data;
+	if (kind == projection_kind::pca) projection->components = (float32*)data;
+}
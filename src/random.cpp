@@ -0,0 +1,58 @@
+#include <random>
+
+#include "random.hpp"
+
+uint64 rotl(uint64 x, int32 k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+// Expand the seed with splitmix64, which is what the xoshiro authors recommend. A seed of zero asks for
+// a nondeterministic seed instead.
+void rng_seed(rng_t* rng, uint64 seed) {
+	if (!seed) {
+		std::random_device device;
+		seed = ((uint64)device() << 32) | device();
+	}
+
+	for (uint32 i = 0; i < 4; i++) {
+		seed += 0x9E3779B97F4A7C15;
+		uint64 z = seed;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+		rng->state[i] = z ^ (z >> 31);
+	}
+}
+
+uint64 rng_next(rng_t* rng) {
+	uint64* s = rng->state;
+	uint64 result = rotl(s[1] * 5, 7) * 9;
+	uint64 t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+
+	return result;
+}
+
+// Uniform in [0, bound) without modulo bias (Lemire's multiply-and-reject)
+uint32 rng_below(rng_t* rng, uint32 bound) {
+	uint64 m = (rng_next(rng) >> 32) * bound;
+	uint32 low = (uint32)m;
+	if (low < bound) {
+		uint32 threshold = (0u - bound) % bound;
+		while (low < threshold) {
+			m = (rng_next(rng) >> 32) * bound;
+			low = (uint32)m;
+		}
+	}
+	return m >> 32;
+}
+
+// Uniform in [0, 1), from the top 24 bits
+float32 rng_float32(rng_t* rng) {
+	return (rng_next(rng) >> 40) * (1.f / 16777216.f);
+}
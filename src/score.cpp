@@ -0,0 +1,201 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#include "types.hpp"
+#include "pack.hpp"
+#include "math.hpp"
+#include "som.hpp"
+#include "model.hpp"
+#include "drift.hpp"
+#include "platform.hpp"
+
+#define AD_FLAG_MODEL "-m"
+#define AD_FLAG_INPUT "-i"
+#define AD_FLAG_OUTPUT "-o"
+#define AD_FLAG_THREADS "-t"
+#define AD_FLAG_QUANTILE "-q"
+#define AD_FLAG_ATTRIBUTION "-k"
+#define AD_FLAG_VERIFY "-v"
+#define AD_FLAG_HELP "-h"
+
+const char* help =
+	"ad_score: score a featurized dataset against a trained model\n\n"
+
+	"usage:\n"
+	"  -m [model_path]: required, path to a model written by ad_train\n"
+	"  -i [input_path]: required, path to a featurized dataset\n"
+	"  -o [output_path]: where to write the scores\n"
+	"  -t [threads]: scoring threads, default one per hardware thread\n"
+	"  -q [quantile]: flag rows scoring above this quantile of the training errors, e.g. 0.999\n"
+	"  -k [features]: also write the features that contributed most to each row's score, up to 16\n"
+	"  -v: check the model's checksum before scoring, which reads the whole file";
+
+int main(int arg_count, char** args) {
+	char model_path  [AD_PATH_SIZE] = { 0 };
+	char input_path  [AD_PATH_SIZE] = { 0 };
+	char output_path [AD_PATH_SIZE] = { 0 };
+	uint32 threads = 0;
+	float64 quantile = 0;
+	uint32 top_k = 0;
+	bool verify = false;
+
+	for (int32 i = 1; i < arg_count; i++) {
+		char* flag = args[i];
+		if (!strcmp(flag, AD_FLAG_MODEL)) {
+			strncpy(model_path, args[++i], AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_INPUT)) {
+			strncpy(input_path, args[++i], AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_OUTPUT)) {
+			strncpy(output_path, args[++i], AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_THREADS)) {
+			threads = atoi(args[++i]);
+		}
+		else if (!strcmp(flag, AD_FLAG_QUANTILE)) {
+			quantile = atof(args[++i]);
+		}
+		else if (!strcmp(flag, AD_FLAG_ATTRIBUTION)) {
+			top_k = atoi(args[++i]);
+		}
+		else if (!strcmp(flag, AD_FLAG_VERIFY)) {
+			verify = true;
+		}
+		else if (!strcmp(flag, AD_FLAG_HELP)) {
+			printf("%s\n", help);
+			exit(0);
+		}
+	}
+
+	if (!strlen(model_path) || !strlen(input_path) || top_k > AD_ATTRIBUTION_MAX) {
+		printf("%s\n", help);
+		exit(1);
+	}
+
+	ad_model_t model;
+	if (model_load(&model, model_path)) {
+		fprintf(stderr, "cannot load model, path = %s\n", model_path);
+		exit(1);
+	}
+	if (verify && !model_verify(&model)) {
+		fprintf(stderr, "model is corrupt, its checksum doesn't match, path = %s\n", model_path);
+		exit(1);
+	}
+
+	// The dataset is mapped rather than read; scoring normalizes each row into scratch space, so it's never written
+	uint64 input_size;
+	char* input = (char*)ad_map_file(input_path, &input_size);
+	if (!input) {
+		fprintf(stderr, "cannot open input file, path = %s\n", input_path);
+		exit(1);
+	}
+
+	ad_featurized_header* header = (ad_featurized_header*)input;
+	if (!featurized_valid(header, input_size, input_path)) exit(1);
+	if (header->features_per_row != (int32)model.header->input_cols) {
+		fprintf(stderr, "dataset has %d features per row, but the model was trained on %d\n", header->features_per_row, model.header->input_cols);
+		exit(1);
+	}
+
+	som_t som;
+	som_init(&som, &model);
+
+	std::vector<uint32> winners(header->rows);
+	std::vector<float32> scores(header->rows);
+	std::vector<attribution_t> attributions(header->rows * top_k);
+
+	auto start = std::chrono::steady_clock::now();
+	if (header->layout == ad_featurized_layout::ad_sparse) {
+		uint32* offsets = (uint32*)(input + sizeof(ad_featurized_header));
+		uint32* columns = offsets + header->rows + 1;
+		float32* values = (float32*)(columns + header->nonzeros);
+
+		sparse_matrix_t rows;
+		spm_init(&rows, values, columns, offsets, header->rows, header->features_per_row);
+		som_predict(&som, rows, winners.data(), scores.data(), threads, attributions.data(), top_k);
+	}
+	else {
+		matrix_t rows;
+		mtx_init(&rows, (float32*)(input + sizeof(ad_featurized_header)), header->rows, header->features_per_row);
+		som_predict(&som, rows, winners.data(), scores.data(), threads, attributions.data(), top_k);
+	}
+	float64 seconds = std::chrono::duration<float64>(std::chrono::steady_clock::now() - start).count();
+	printf("scored %d rows in %.3f ms (%.2f million rows/s)\n", header->rows, seconds * 1000, header->rows / seconds / 1e6);
+
+	// The cutoff comes straight from the digest stored with the model, so there's nothing to sort
+	ad_scores_header scores_header;
+	scores_header.rows = header->rows;
+	scores_header.clusters = model.weights.rows;
+	scores_header.top_k = top_k;
+	if (quantile) {
+		scores_header.threshold = td_quantile(model.error_digest, quantile);
+		for (float32 score : scores) scores_header.flagged += score > scores_header.threshold;
+		printf("flagged %d rows scoring above %f, the %g quantile of the training errors\n", scores_header.flagged, scores_header.threshold, quantile);
+	}
+
+	// Show why the worst row scored the way it did
+	if (top_k && header->rows) {
+		uint32 worst = std::max_element(scores.begin(), scores.end()) - scores.begin();
+		printf("row %d scored %f; top features:", worst, scores[worst]);
+		for (uint32 i = 0; i < top_k; i++) {
+			attribution_t* attribution = &attributions[worst * top_k + i];
+			if (attribution->feature == AD_ATTRIBUTION_NONE) break;
+			printf(" %d (%f)", attribution->feature, f16_to_f32(attribution->contribution));
+		}
+		printf("\n");
+	}
+
+	// Compare the traffic with what the model saw in training, a window of rows at a time. With no rows there's
+	// nothing to compare, or to time.
+	if (header->rows) {
+		drift_baseline_t baseline;
+		drift_baseline_init(&baseline, &model);
+		drift_monitor_t monitor;
+		drift_init(&monitor, &baseline);
+
+		config_t* config = &model.header->config;
+		uint32 window = config->drift_window ? config->drift_window : AD_DRIFT_WINDOW;
+		uint32 windows = 0;
+		uint32 drifted = 0;
+		float64 observe_seconds = 0;
+		for (uint32 begin = 0; begin < (uint32)header->rows; begin += window) {
+			uint32 end = begin + window < (uint32)header->rows ? begin + window : header->rows;
+			start = std::chrono::steady_clock::now();
+			for (uint32 row = begin; row < end; row++) drift_observe(&monitor, winners[row], scores[row]);
+			observe_seconds += std::chrono::duration<float64>(std::chrono::steady_clock::now() - start).count();
+
+			drift_report_t report = drift_check(&monitor, config);
+			windows++;
+			drifted += report.retrain;
+			if (report.retrain) {
+				printf("drift in rows [%d, %d): hit psi = %f, error psi = %f, error ks = %f, retrain recommended\n",
+					   begin, end, report.hit_psi, report.error_psi, report.error_ks);
+			}
+		}
+		printf("drift: %d of %d windows drifted, %.2f ns/row to observe\n", drifted, windows, observe_seconds * 1e9 / header->rows);
+		drift_free(&monitor);
+		drift_baseline_free(&baseline);
+	}
+
+	if (strlen(output_path)) {
+		FILE* file = fopen(output_path, "wb");
+		if (!file) {
+			fprintf(stderr, "cannot open output file, path = %s\n", output_path);
+			exit(1);
+		}
+		fwrite(&scores_header, sizeof(ad_scores_header), 1, file);
+		fwrite(winners.data(), sizeof(uint32), winners.size(), file);
+		fwrite(scores.data(), sizeof(float32), scores.size(), file);
+		fwrite(attributions.data(), sizeof(attribution_t), attributions.size(), file);
+		fclose(file);
+	}
+
+	ad_unmap_file(input, input_size);
+	model_free(&model);
+	return 0;
+}
@@ -3,6 +3,8 @@
 #include <cstdlib>
 #include <cmath>
 #include <float.h>
+#include <algorithm>
+#include <vector>
 #ifdef _WIN32
 #include <assert.h>
 #endif
@@ -12,6 +14,9 @@
 #include "types.hpp"
 #include "math.hpp"
 #include "som.hpp"
+#include "kernels.hpp"
+#include "projection.hpp"
+#include "utils.hpp"
 
 int ini_load_value(void* user, const char* section, const char* name, const char* value) {
     config_t* config = (config_t*)user;
@@ -20,20 +25,53 @@ int ini_load_value(void* user, const char* section, const char* name, const char
 	#define COPY_STRING(s, n) if (MATCH(s, #n)) strncpy(config->n, value, strlen(value))
 	#define COPY_U32(s, n) if (MATCH(s, #n)) config->n = atoi(value);
 	#define COPY_F32(s, n) if (MATCH(s, #n)) config->n = atof(value);
-#define COPY_BOOL(s, n) if (MATCH(s, #n)) config->n = (s[0] == 't' ? true : false);
+	#define COPY_BOOL(s, n) if (MATCH(s, #n)) config->n = (value[0] == 't' ? true : false);
 
 	COPY_STRING("generator", name);
 	COPY_STRING("generator", generator_function);
 	COPY_STRING("generator", raw_data_file);
 	COPY_STRING("generator", featurized_data_file);
 	COPY_STRING("generator", results_file);
+	COPY_BOOL  ("generator", sparse);
 
+	COPY_STRING("som", engine);
 	COPY_STRING("som", neighborhood_function);
+	COPY_STRING("som", input_precision);
+	COPY_STRING("som", weight_layout);
+	COPY_STRING("som", input_ordering);
+	COPY_STRING("som", metric);
+	COPY_STRING("som", feature_weights);
 	COPY_U32   ("som", count_clusters);
 	COPY_F32   ("som", learning_rate);
 	COPY_F32   ("som", decay_rate);
+	COPY_F32   ("som", neighborhood_radius);
+	COPY_F32   ("som", warm_learning_rate);
+	COPY_F32   ("som", warm_radius);
+	COPY_F32   ("som", warm_decay_rate);
 	COPY_F32   ("som", error_threshold);
 	COPY_U32   ("som", seed);
+	COPY_STRING("som", checkpoint_file);
+	COPY_U32   ("som", checkpoint_interval);
+	COPY_U32   ("som", threads);
+	COPY_BOOL  ("som", compact);
+	COPY_F32   ("som", merge_distance);
+	COPY_U32   ("som", batch_size);
+
+	COPY_U32   ("online", window_rows);
+	COPY_U32   ("online", retrain_interval);
+	COPY_U32   ("online", retrain_epochs);
+
+	COPY_U32   ("drift", drift_window);
+	COPY_F32   ("drift", drift_psi);
+	COPY_F32   ("drift", drift_ks);
+
+	COPY_U32   ("index", pq_subspaces);
+	COPY_U32   ("index", pq_shortlist);
+	COPY_STRING("index", codebook);
+	COPY_U32   ("index", codebook_rerank);
+
+	COPY_STRING("reduction", reduction);
+	COPY_U32   ("reduction", reduced_dimensions);
 
 	COPY_BOOL  ("som", quiet);
 	COPY_BOOL  ("som", write_output);
@@ -46,19 +84,72 @@ void cfg_save(config_t* cfg, const char* path) {
 
 	static const char* section_generator = "[generator]\n";
 	static const char* section_som = "[som]\n";
+	static const char* section_online = "[online]\n";
+	static const char* section_drift = "[drift]\n";
+	static const char* section_index = "[index]\n";
+	static const char* section_reduction = "[reduction]\n";
 	fwrite(section_generator, strlen(section_generator), 1, file);
 	fprintf(file, "name = %s\n", cfg->name);
 	fprintf(file, "generator_function = %s\n", cfg->generator_function);
 	fprintf(file, "raw_data_file = %s\n", cfg->raw_data_file);
 	fprintf(file, "featurized_data_file = %s\n", cfg->featurized_data_file);
+	fprintf(file, "sparse = %s\n", cfg->sparse ? "true" : "false");
 
 	fwrite(section_som, strlen(section_som), 1, file);
+	if (strlen(cfg->engine)) fprintf(file, "engine = %s\n", cfg->engine);
 	fprintf(file, "neighborhood_function = %s\n", cfg->neighborhood_function);
+	if (strlen(cfg->input_precision)) fprintf(file, "input_precision = %s\n", cfg->input_precision);
+	if (strlen(cfg->weight_layout)) fprintf(file, "weight_layout = %s\n", cfg->weight_layout);
+	if (strlen(cfg->input_ordering)) fprintf(file, "input_ordering = %s\n", cfg->input_ordering);
+	if (strlen(cfg->metric)) fprintf(file, "metric = %s\n", cfg->metric);
+	if (strlen(cfg->feature_weights)) fprintf(file, "feature_weights = %s\n", cfg->feature_weights);
 	fprintf(file, "learning_rate = %f\n", cfg->learning_rate);
 	fprintf(file, "decay_rate = %f\n", cfg->decay_rate);
+	if (cfg->neighborhood_radius) fprintf(file, "neighborhood_radius = %f\n", cfg->neighborhood_radius);
+	if (cfg->warm_learning_rate) fprintf(file, "warm_learning_rate = %f\n", cfg->warm_learning_rate);
+	if (cfg->warm_radius) fprintf(file, "warm_radius = %f\n", cfg->warm_radius);
+	if (cfg->warm_decay_rate) fprintf(file, "warm_decay_rate = %f\n", cfg->warm_decay_rate);
 	fprintf(file, "count_clusters = %d\n", cfg->count_clusters);
 	fprintf(file, "error_threshold = %f\n", cfg->error_threshold);
 	fprintf(file, "seed = %d\n", cfg->seed);
+	if (strlen(cfg->checkpoint_file)) fprintf(file, "checkpoint_file = %s\n", cfg->checkpoint_file);
+	if (cfg->checkpoint_interval) fprintf(file, "checkpoint_interval = %d\n", cfg->checkpoint_interval);
+	if (cfg->threads) fprintf(file, "threads = %d\n", cfg->threads);
+	if (cfg->compact) fprintf(file, "compact = true\n");
+	if (cfg->merge_distance) fprintf(file, "merge_distance = %f\n", cfg->merge_distance);
+	if (cfg->batch_size) fprintf(file, "batch_size = %d\n", cfg->batch_size);
+
+	if (cfg->window_rows) {
+		fwrite(section_online, strlen(section_online), 1, file);
+		fprintf(file, "window_rows = %d\n", cfg->window_rows);
+		fprintf(file, "retrain_interval = %d\n", cfg->retrain_interval);
+		fprintf(file, "retrain_epochs = %d\n", cfg->retrain_epochs);
+	}
+
+	if (cfg->drift_window || cfg->drift_psi || cfg->drift_ks) {
+		fwrite(section_drift, strlen(section_drift), 1, file);
+		fprintf(file, "drift_window = %d\n", cfg->drift_window);
+		fprintf(file, "drift_psi = %f\n", cfg->drift_psi);
+		fprintf(file, "drift_ks = %f\n", cfg->drift_ks);
+	}
+
+	if (cfg->pq_subspaces || strlen(cfg->codebook)) {
+		fwrite(section_index, strlen(section_index), 1, file);
+	}
+	if (cfg->pq_subspaces) {
+		fprintf(file, "pq_subspaces = %d\n", cfg->pq_subspaces);
+		fprintf(file, "pq_shortlist = %d\n", cfg->pq_shortlist);
+	}
+	if (strlen(cfg->codebook)) {
+		fprintf(file, "codebook = %s\n", cfg->codebook);
+		fprintf(file, "codebook_rerank = %d\n", cfg->codebook_rerank);
+	}
+
+	if (strlen(cfg->reduction)) {
+		fwrite(section_reduction, strlen(section_reduction), 1, file);
+		fprintf(file, "reduction = %s\n", cfg->reduction);
+		fprintf(file, "reduced_dimensions = %d\n", cfg->reduced_dimensions);
+	}
 	fclose(file);
 }
 
@@ -69,68 +160,437 @@ void cfg_load(config_t* config, const char* path) {
     }
 }
 
-float32 ns_linear(uint32 winning_cluster, uint32 neighbor_cluster) {
-	int32 max_distance = 2;
-	float32 decay = .5;
-	
+float32 ns_linear(uint32 winning_cluster, uint32 neighbor_cluster, float32 radius) {
 	int32 distance = abs((int32)neighbor_cluster - (int32)winning_cluster);
-	if (distance > max_distance) return 0;
-	
-	return 1 - (distance * decay);
+	return fmax(1 - distance / radius, 0);
 }
 
-float32 ns_none(uint32 winning_cluster, uint32 neighbor_cluster) {
+float32 ns_none(uint32 winning_cluster, uint32 neighbor_cluster, float32) {
 	if (neighbor_cluster == winning_cluster) return 1;
 	return 0;
 }
 
-void som_init(som_t* som, float32* input_data, uint32 rows, uint32 cols) {
-	if (som->config.seed) srand(som->config.seed);
+float32 som_neighborhood_radius(config_t* config) {
+	return config->neighborhood_radius ? config->neighborhood_radius : AD_NEIGHBORHOOD_RADIUS;
+}
+
+// Set up everything that doesn't depend on how the inputs are stored: the weights, the deltas, and
+// the order to visit the inputs in, which is reshuffled at the start of every epoch.
+void som_init_common(som_t* som, uint32 rows, uint32 cols) {
+	rng_seed(&som->rng, som->config.seed);
+	som_select_kernels(som, cols);
+	som->radius = som_neighborhood_radius(&som->config);
 
-	mtx_init(&som->inputs, input_data, rows, cols);
 	mtx_init(&som->weights, som->config.count_clusters, cols);
 	mtx_init(&som->deltas, som->config.count_clusters, cols);
 	vec_init(&som->winners, rows);
+	vec_init(&som->distances, rows);
 	arr_init(&som->input_order, rows);
 
+	if (!strcmp(som->config.input_ordering, "gather")) som->ordering = input_ordering::gather;
+	if (!strcmp(som->config.input_ordering, "block"))  som->ordering = input_ordering::block;
 	for (uint32 i = 0; i < rows; i++) arr_push(&som->input_order, i);
-	for (uint32 i = 0; i < rows; i++) {
-		float32 j = rand() % rows;
-		uint32* vi = som->input_order[i];
-		uint32* vj = som->input_order[j];
-		uint32  vt = *vi;
 
-		*vi = *vj;
-		*vj = vt;
+	if (!strcmp(som->config.engine, "kmeans")) {
+		som->engine = som_engine::kmeans;
+		arr_init(&som->unit_counts, som->config.count_clusters, (uint32)0);
 	}
 
-	mtx_for(som->inputs, input) {
-		vec_normalize(input);
+	uint32 threads = som->config.threads ? som->config.threads : 1;
+	arr_init(&som->workers, threads);
+	arr_init(&som->cluster_stats, som->config.count_clusters, cluster_stats_t());
+	for (uint32 i = 0; i < threads; i++) {
+		som_worker_t* worker = arr_push(&som->workers);
+		if (i) mtx_init(&worker->deltas, som->config.count_clusters, cols);
+		else worker->deltas = som->deltas;
+		if (som->ordering == input_ordering::gather) mtx_init(&worker->staging, AD_ORDER_BLOCK, cols);
+		arr_init(&worker->stats, som->config.count_clusters, cluster_stats_t());
 	}
 
 	mtx_for(som->weights, weight) {
 		vec_for(weight, w) {
-			*w = rand_float32(1);
+			*w = rng_float32(&som->rng);
 		}
 	}
 	mtx_for(som->weights, weight) {
 		vec_normalize(weight);
 	}
+
+	if (som->is_soa) {
+		soa_init(&som->soa_weights, som->weights.rows, som->weights.cols);
+		soa_from_mtx(som->soa_weights, som->weights);
+	}
+}
+
+void som_init(som_t* som, float32* input_data, uint32 rows, uint32 cols) {
+	mtx_init(&som->inputs, input_data, rows, cols);
+	som_init_common(som, rows, cols);
+
+	mtx_for(som->inputs, input) {
+		vec_normalize(input);
+	}
+
+	// Narrow the inputs after normalizing, so the rounding happens once on the values training sees
+	bool fp16 = !strcmp(som->config.input_precision, "fp16");
+	bool bf16 = !strcmp(som->config.input_precision, "bf16");
+	if (fp16 || bf16) {
+		som->is_half = true;
+		hmtx_init(&som->half_inputs, som->inputs, fp16 ? half_format::fp16 : half_format::bf16);
+		arr_for(som->workers, worker) vec_init(&worker->input_scratch, cols);
+	}
+}
+
+void som_init(som_t* som, sparse_matrix_t* inputs) {
+	som->is_sparse = true;
+	som->sparse_inputs = *inputs;
+	mtx_init(&som->inputs, nullptr, 0, inputs->cols);
+	som_init_common(som, inputs->rows, inputs->cols);
+	if (som->metric != distance_metric::l2sq) {
+		fprintf(stderr, "sparse inputs are always trained with metric = l2sq, ignoring metric = %s\n", som->config.metric);
+		som->metric = distance_metric::l2sq;
+	}
+	vec_init(&som->weight_norms, som->config.count_clusters);
+	vec_init(&som->delta_strength, som->config.count_clusters);
+	arr_for(som->workers, worker) {
+		if (arr_indexof(&som->workers, worker)) vec_init(&worker->delta_strength, som->config.count_clusters);
+		else worker->delta_strength = som->delta_strength;
+	}
+
+	spm_for(som->sparse_inputs, input) {
+		vec_normalize(input);
+	}
+}
+
+// Free everything som_init allocated. The inputs belong to the caller, and so do the weights of a SOM set up
+// from a model, so this is only for SOMs set up from inputs.
+void som_free(som_t* som) {
+	free(som->weights.data);
+	free(som->deltas.data);
+	vec_free(som->winners);
+	vec_free(som->distances);
+	vec_free(som->feature_weights);
+	arr_free(&som->input_order);
+	arr_free(&som->cluster_stats);
+	arr_free(&som->probe_order);
+	arr_free(&som->unit_counts);
+
+	arr_for(som->workers, worker) {
+		if (arr_indexof(&som->workers, worker)) {
+			free(worker->deltas.data);
+			if (som->is_sparse) vec_free(worker->delta_strength);
+		}
+		free(worker->input_scratch.data);
+		free(worker->staging.data);
+		arr_free(&worker->stats);
+	}
+	arr_free(&som->workers);
+
+	if (som->is_sparse) {
+		vec_free(som->weight_norms);
+		vec_free(som->delta_strength);
+	}
+	if (som->is_half) hmtx_free(som->half_inputs);
+	if (som->is_soa) soa_free(som->soa_weights);
+}
+
+// Start from weights trained earlier instead of random ones. They're already close, so training only has to
+// follow what's changed since: the learning rate starts smaller and decays to nothing sooner, and the
+// neighborhood is narrower. By default that's a quarter of the learning rate and decay rate, and three
+// quarters of the radius.
+void som_warm_start(som_t* som, matrix_t& weights) {
+	memcpy(som->weights.data, weights.data, sizeof(float32) * mtx_size(som->weights));
+	if (som->is_soa) soa_from_mtx(som->soa_weights, som->weights);
+
+	config_t* config = &som->config;
+	config->learning_rate = config->warm_learning_rate ? config->warm_learning_rate : config->learning_rate / 4;
+	config->decay_rate = config->warm_decay_rate ? config->warm_decay_rate : config->decay_rate / 4;
+	som->radius = config->warm_radius ? config->warm_radius : som->radius * 3 / 4;
+}
+
+// Fisher-Yates shuffle of the first count entries of order
+void shuffle(rng_t* rng, uint32* order, uint32 count) {
+	for (uint32 i = count - 1; i > 0; i--) {
+		uint32 j = rng_below(rng, i + 1);
+		uint32 t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+}
+
+// Fill input_order with a random permutation of the inputs. For block ordering, the permutation only moves
+// whole blocks of consecutive rows. The order is rebuilt from scratch each time, so it only depends on the
+// state of the generator.
+void som_shuffle(som_t* som) {
+	uint32 rows = som->input_order.capacity;
+	if (!rows) return;
+	arr_fastclear(&som->input_order);
+
+	if (som->ordering == input_ordering::block) {
+		uint32 count_blocks = (rows + AD_ORDER_BLOCK - 1) / AD_ORDER_BLOCK;
+		array_t<uint32> blocks;
+		arr_init(&blocks, count_blocks);
+		for (uint32 i = 0; i < count_blocks; i++) arr_push(&blocks, i);
+		shuffle(&som->rng, blocks.data, count_blocks);
+
+		arr_for(blocks, block) {
+			uint32 begin = *block * AD_ORDER_BLOCK;
+			uint32 end = begin + AD_ORDER_BLOCK < rows ? begin + AD_ORDER_BLOCK : rows;
+			for (uint32 i = begin; i < end; i++) arr_push(&som->input_order, i);
+		}
+		arr_free(&blocks);
+		return;
+	}
+
+	for (uint32 i = 0; i < rows; i++) arr_push(&som->input_order, i);
+	shuffle(&som->rng, som->input_order.data, rows);
+}
+
+// Pick kernels for this metric unrolled for this many features, or the generic ones if there's no specialization
+template<typename Metric>
+void som_select_metric_kernels(som_t* som, uint32 features) {
+	#define SELECT_KERNELS(n) \
+		case n: \
+			som->kernels.find_bmu = &find_bmu_n<Metric, n>; \
+			som->kernels.calculate_weight_deltas = &calculate_weight_deltas_n<n>; \
+			break;
+
+	som->kernels.find_bmu = &find_bmu_metric<Metric>;
+	som->kernels.calculate_weight_deltas = &calculate_weight_deltas;
+	som->kernels.distance_bounded = &distance_bounded<Metric>;
+	som->kernels.distance_contributions = &distance_contributions<Metric>;
+
+	switch (features) {
+		SELECT_KERNELS(2)
+		SELECT_KERNELS(4)
+		SELECT_KERNELS(8)
+		SELECT_KERNELS(16)
+		SELECT_KERNELS(32)
+	}
+}
+
+// Feature weights default to one. A list that doesn't match the features is ignored rather than guessed at.
+void som_init_feature_weights(som_t* som, uint32 features) {
+	vec_init(&som->feature_weights, features);
+	vec_for(som->feature_weights, weight) *weight = 1;
+	if (som->metric != distance_metric::weighted_l2) return;
+
+	uint32 count = 0;
+	char* value = som->config.feature_weights;
+	char* end = nullptr;
+	for (float32 weight = strtof(value, &end); end != value; weight = strtof(value, &end)) {
+		if (count < features) som->feature_weights[count] = weight;
+		count++;
+		value = end;
+		while (*value == ',' || *value == ' ') value++;
+	}
+
+	if (count != features) {
+		fprintf(stderr, "expected %d feature_weights, found %d; weighting every feature equally\n", features, count);
+		vec_for(som->feature_weights, weight) *weight = 1;
+	}
+}
+
+distance_metric metric_from_name(const char* name) {
+	if (!strcmp(name, "cosine"))      return distance_metric::cosine;
+	if (!strcmp(name, "l1"))          return distance_metric::l1;
+	if (!strcmp(name, "weighted_l2")) return distance_metric::weighted_l2;
+	return distance_metric::l2sq;
+}
+
+void som_select_kernels(som_t* som, uint32 features) {
+	if (strlen(som->config.metric)) som->metric = metric_from_name(som->config.metric);
+	som_init_feature_weights(som, features);
+
+	switch (som->metric) {
+		case distance_metric::l2sq:        som_select_metric_kernels<metric_l2sq>(som, features); break;
+		case distance_metric::cosine:      som_select_metric_kernels<metric_cosine>(som, features); break;
+		case distance_metric::l1:          som_select_metric_kernels<metric_l1>(som, features); break;
+		case distance_metric::weighted_l2: som_select_metric_kernels<metric_weighted_l2>(som, features); break;
+	}
+
+	// The feature-major layout vectorizes across clusters instead, so it doesn't need specializing; it only
+	// knows squared Euclidean distance, though
+	som->is_soa = !strcmp(som->config.weight_layout, "soa") && som->metric == distance_metric::l2sq;
+	if (som->is_soa) som->kernels.find_bmu = &find_bmu_soa;
+}
+
+// Per-cluster stats are kept in units of distance, so squared metrics are square rooted first
+float32 som_stats_distance(som_t* som, float32 distance) {
+	bool squared = som->metric == distance_metric::l2sq || som->metric == distance_metric::weighted_l2;
+	return squared ? sqrt(distance) : distance;
+}
+
+// The map is a line of units, so two units are neighbors if their indices are one apart
+bool som_adjacent(uint32 a, uint32 b) {
+	return a == b || a + 1 == b || b + 1 == a;
+}
+
+void cluster_stats_add(cluster_stats_t* stats, float32 distance) {
+	stats->hits++;
+	float64 difference = distance - stats->mean;
+	stats->mean += difference / stats->hits;
+	stats->m2 += difference * (distance - stats->mean);
+	stats->radius = fmax(stats->radius, distance);
+}
+
+void cluster_stats_reset(array_t<cluster_stats_t>* stats) {
+	arr_for(*stats, cluster) *cluster = cluster_stats_t();
+}
+
+// Chan et al.'s pairwise update, so the merged variance is as good as if one thread had seen every input
+void cluster_stats_merge(cluster_stats_t* into, cluster_stats_t* from) {
+	if (!from->hits) return;
+
+	uint32 hits = into->hits + from->hits;
+	float64 difference = from->mean - into->mean;
+	into->mean += difference * from->hits / hits;
+	into->m2 += from->m2 + difference * difference * into->hits * from->hits / hits;
+	into->radius = fmax(into->radius, from->radius);
+	into->hits = hits;
+}
+
+float64 cluster_stats_variance(cluster_stats_t* stats) {
+	return stats->hits ? stats->m2 / stats->hits : 0;
+}
+
+// Everything an epoch does with one input: find its winner, accumulate deltas toward it, and add its share of
+// the quantization and topographic error and of its winner's stats
+void som_train_row(som_t* som, som_worker_t* worker, vector_t& input, uint32 row) {
+	bmu_t bmu;
+	som->kernels.find_bmu(som, input, &bmu);
+	som->kernels.calculate_weight_deltas(som, worker, input, bmu.winner);
+	som->winners[row] = bmu.winner;
+	som->distances[row] = bmu.distance;
+
+	worker->epoch.quantization_error += bmu.distance;
+	worker->epoch.topographic_error += !som_adjacent(bmu.winner, bmu.runner_up);
+	cluster_stats_add(worker->stats[bmu.winner], som_stats_distance(som, bmu.distance));
+}
+
+// Train on the inputs at [begin, end) of the shuffled order
+void som_train_rows(som_t* som, som_worker_t* worker, uint32 begin, uint32 end) {
+	uint32* order = som->input_order.data;
+
+	if (som->is_sparse) {
+		for (uint32 i = begin; i < end; i++) {
+			sparse_vector_t input = spm_at(som->sparse_inputs, order[i]);
+			bmu_t bmu;
+			find_bmu(som, input, &bmu);
+			calculate_weight_deltas(som, worker, input, bmu.winner);
+			som->winners[order[i]] = bmu.winner;
+			som->distances[order[i]] = bmu.distance;
+
+			worker->epoch.quantization_error += bmu.distance;
+			worker->epoch.topographic_error += !som_adjacent(bmu.winner, bmu.runner_up);
+			cluster_stats_add(worker->stats[bmu.winner], som_stats_distance(som, bmu.distance));
+		}
+	}
+	else if (som->is_half) {
+		for (uint32 i = begin; i < end; i++) {
+			hmtx_load(som->half_inputs, order[i], worker->input_scratch);
+			som_train_row(som, worker, worker->input_scratch, order[i]);
+		}
+	}
+	else if (som->ordering == input_ordering::gather) {
+		som_iterate_gathered(som, worker, begin, end);
+	}
+	else {
+		for (uint32 i = begin; i < end; i++) {
+			vector_t input = mtx_at(som->inputs, order[i]);
+			som_train_row(som, worker, input, order[i]);
+		}
+	}
 }
 
-void som_iterate(som_t* som) {
+// One pass over the inputs in a fresh random order, split across the workers. The errors and stats come for
+// free from the winner search, so there's no need for a second pass over the data to measure them.
+som_epoch_t som_iterate(som_t* som) {
 	som->iteration++;
+	som_shuffle(som);
+	if (som->is_sparse) update_weight_norms(som);
 
-	arr_for(som->input_order, i) {
-		vector_t input = mtx_at(som->inputs, *i);
-		uint32 cluster = find_winning_cluster(som, input);
-		calculate_weight_deltas(som, input, cluster);
-		som->winners[*i] = cluster;
+	arr_for(som->workers, worker) {
+		worker->epoch = som_epoch_t();
+		cluster_stats_reset(&worker->stats);
+	}
+
+	ad_parallel_for(som->input_order.size, som->workers.size, [&](uint32 begin, uint32 end, uint32 thread) {
+		som_train_rows(som, som->workers[thread], begin, end);
+	});
+
+	// The first worker accumulated straight into the SOM's deltas; add everyone else's in
+	som_epoch_t epoch;
+	cluster_stats_reset(&som->cluster_stats);
+	arr_for(som->workers, worker) {
+		epoch.quantization_error += worker->epoch.quantization_error;
+		epoch.topographic_error += worker->epoch.topographic_error;
+		for (uint32 cluster = 0; cluster < (uint32)som->cluster_stats.size; cluster++) {
+			cluster_stats_merge(som->cluster_stats[cluster], worker->stats[cluster]);
+		}
+
+		if (worker == som->workers.data) continue;
+		mtx_add(som->deltas, worker->deltas);
+		memset(worker->deltas.data, 0, sizeof(float32) * mtx_size(worker->deltas));
+		if (som->is_sparse) {
+			for (uint32 cluster = 0; cluster < som->delta_strength.size; cluster++) {
+				som->delta_strength[cluster] += worker->delta_strength[cluster];
+				worker->delta_strength[cluster] = 0;
+			}
+		}
+	}
+
+	if (som->input_order.size) epoch.topographic_error /= som->input_order.size;
+	return epoch;
+}
+
+// Train on a slice of the shuffled inputs a block at a time. Each block's rows are copied into the worker's
+// staging buffer in shuffle order, with the rows a little further ahead prefetched, so the kernels only ever
+// read contiguous memory. Winners are scattered back to each row's original position.
+void som_iterate_gathered(som_t* som, som_worker_t* worker, uint32 begin, uint32 end) {
+	uint32 cols = som->inputs.cols;
+	uint32* order = som->input_order.data;
+
+	for (uint32 block = begin; block < end; block += AD_ORDER_BLOCK) {
+		uint32 count = end - block < AD_ORDER_BLOCK ? end - block : AD_ORDER_BLOCK;
+
+		for (uint32 i = 0; i < count; i++) {
+			if (block + i + AD_PREFETCH_DISTANCE < end) {
+				float32* ahead = som->inputs.data + order[block + i + AD_PREFETCH_DISTANCE] * cols;
+				for (uint32 j = 0; j < cols; j += 64 / sizeof(float32)) ad_prefetch(ahead + j);
+			}
+			memcpy(mtx_at(worker->staging, i, 0), som->inputs.data + order[block + i] * cols, cols * sizeof(float32));
+		}
+
+		for (uint32 i = 0; i < count; i++) {
+			vector_t input = mtx_at(worker->staging, i);
+			som_train_row(som, worker, input, order[block + i]);
+		}
 	}
 }
 
 float32 som_error(som_t* som) {
 	float32 error = 0;
+	if (som->is_sparse) {
+		update_weight_norms(som);
+		for (uint32 i = 0; i < som->sparse_inputs.rows; i++) {
+			sparse_vector_t input = spm_at(som->sparse_inputs, i);
+			uint32 cluster = som->winners[i];
+			vector_t weight = mtx_at(som->weights, cluster);
+			error += squared_error(weight, som->weight_norms[cluster], input);
+		}
+		return error;
+	}
+
+	if (som->is_half) {
+		vector_t& scratch = som->workers[0]->input_scratch;
+		for (uint32 i = 0; i < som->half_inputs.rows; i++) {
+			hmtx_load(som->half_inputs, i, scratch);
+			vector_t weight = mtx_at(som->weights, som->winners[i]);
+			error += squared_error(weight, scratch);
+		}
+		return error;
+	}
+
 	mtx_for(som->inputs, input) {
 		uint32 cluster = som->winners[mtx_indexof(som->inputs, input)];
 		vector_t weight = mtx_at(som->weights, cluster);
@@ -140,19 +600,13 @@ float32 som_error(som_t* som) {
 }
 
 uint32 find_winning_cluster(som_t* som, vector_t& input) {
-	uint32 winning_cluster = 0;
-	float32 min_distance = FLT_MAX;
-	
-	mtx_for(som->weights, weight) {
-		uint32 cluster = mtx_indexof(som->weights, weight);
-		float32 distance = vec_distance(input, weight);
-		if (min_distance > distance) {
-			winning_cluster = cluster;
-			min_distance = distance;
-		}
-	}
+	bmu_t bmu;
+	som->kernels.find_bmu(som, input, &bmu);
+	return bmu.winner;
+}
 
-	return winning_cluster;
+void find_bmu_soa(som_t* som, vector_t& input, bmu_t* bmu) {
+	bmu->winner = soa_find_nearest(som->soa_weights, input, &bmu->distance, &bmu->runner_up);
 }
 
 float32 decayed_learning_rate(som_t* som) {
@@ -160,12 +614,12 @@ float32 decayed_learning_rate(som_t* som) {
 	return fmax(decayed, 0);
 }
 
-void calculate_weight_deltas(som_t* som, vector_t& input, uint32 winning_cluster) {
+void calculate_weight_deltas(som_t* som, som_worker_t* worker, vector_t& input, uint32 winning_cluster) {
 	mtx_for(som->weights, weight) {
 		uint32 cluster = mtx_indexof(som->weights, weight);
-		float32 strength = ns_linear(winning_cluster, cluster);
-		for (int i = 0; i < input.size; i++) {
-			*mtx_at(som->deltas, cluster, i) += decayed_learning_rate(som) * strength * (input[i] - weight[i]);
+		float32 strength = ns_linear(winning_cluster, cluster, som->radius);
+		for (uint32 i = 0; i < input.size; i++) {
+			*mtx_at(worker->deltas, cluster, i) += decayed_learning_rate(som) * strength * (input[i] - weight[i]);
 		}
 	}	
 }
@@ -173,14 +627,322 @@ void calculate_weight_deltas(som_t* som, vector_t& input, uint32 winning_cluster
 float32 squared_error(vector_t& weight, vector_t& input) {
 	float32 error = 0;
 	for (uint32 i = 0; i < input.size; i++) {
-		error += pow(input[i] - weight[i], 2);
+		float32 difference = input[i] - weight[i];
+		error += difference * difference;
 	}
 
 	return error;
 }
 
 void apply_deltas(som_t* som) {
+	// The sparse kernels only accumulated the input half of each update; subtract the weight half now
+	if (som->is_sparse) {
+		mtx_for(som->deltas, delta) {
+			uint32 cluster = mtx_indexof(som->deltas, delta);
+			vector_t weight = mtx_at(som->weights, cluster);
+			for (uint32 i = 0; i < delta.size; i++) delta[i] -= som->delta_strength[cluster] * weight[i];
+			som->delta_strength[cluster] = 0;
+		}
+	}
+
 	mtx_scale(som->deltas, 1.f / mtx_size(som->deltas));
 	mtx_add(som->weights, som->deltas);
 	memset(som->deltas.data, 0, sizeof(float32) * mtx_size(som->deltas));
+
+	// Cosine distance is computed as 1 - x.w, which needs the weights to stay on the unit sphere like the inputs
+	if (som->metric == distance_metric::cosine) {
+		mtx_for(som->weights, weight) vec_normalize(weight);
+	}
+
+	if (som->is_soa) soa_from_mtx(som->soa_weights, som->weights);
+}
+
+// Sparse kernels. Weights are dense, so the distance to a sparse input is expanded as
+// ||x||^2 - 2x.w + ||w||^2, which only touches the input's nonzeros once ||w||^2 is known.
+void update_weight_norms(som_t* som) {
+	mtx_for(som->weights, weight) {
+		uint32 cluster = mtx_indexof(som->weights, weight);
+		float32 norm = 0;
+		vec_for(weight, w) norm += *w * *w;
+		som->weight_norms[cluster] = norm;
+	}
+}
+
+void find_bmu(som_t* som, sparse_vector_t& input, bmu_t* bmu) {
+	float32 second_distance;
+	bmu_init(bmu, &second_distance);
+
+	float32 input_norm = 0;
+	spv_for(input, i) input_norm += input.values[i] * input.values[i];
+
+	mtx_for(som->weights, weight) {
+		uint32 cluster = mtx_indexof(som->weights, weight);
+		float32 distance = input_norm - 2 * vec_dot(input, weight) + som->weight_norms[cluster];
+		bmu_update(bmu, &second_distance, cluster, fmax(distance, 0));
+	}
+}
+
+void calculate_weight_deltas(som_t* som, som_worker_t* worker, sparse_vector_t& input, uint32 winning_cluster) {
+	float32 learning_rate = decayed_learning_rate(som);
+	for (uint32 cluster = 0; cluster < som->weights.rows; cluster++) {
+		float32 strength = ns_linear(winning_cluster, cluster, som->radius);
+		if (!strength) continue;
+
+		// delta += rate * (x - w). The -rate * w half is the same for every input in the epoch, since
+		// weights only change in apply_deltas, so only its coefficient is tracked here.
+		float32 rate = learning_rate * strength;
+		float32* delta = mtx_at(worker->deltas, cluster, 0);
+		spv_for(input, i) {
+			delta[input.indices[i]] += rate * input.values[i];
+		}
+		worker->delta_strength[cluster] += rate;
+	}
+}
+
+float32 squared_error(vector_t& weight, float32 weight_norm, sparse_vector_t& input) {
+	float32 input_norm = 0;
+	spv_for(input, i) input_norm += input.values[i] * input.values[i];
+
+	float32 error = input_norm - 2 * vec_dot(input, weight) + weight_norm;
+	return fmax(error, 0);
+}
+
+// Compaction
+uint32 som_compact(som_t* som, float32 merge_distance, uint32* remap) {
+	uint32 clusters = som->weights.rows;
+	uint32 cols = som->weights.cols;
+	float32* weights = som->weights.data;
+
+	std::vector<float32> hits(clusters, 0); // Hits of each kept unit, including whatever was merged into it
+	uint32 kept = 0;
+	for (uint32 cluster = 0; cluster < clusters; cluster++) {
+		remap[cluster] = AD_UNIT_PRUNED;
+		uint32 cluster_hits = som->cluster_stats.data[cluster].hits;
+		if (!cluster_hits) continue;
+
+		float32* weight = weights + cluster * cols;
+		uint32 into = kept;
+		for (uint32 other = 0; other < kept; other++) {
+			float32 distance = 0;
+			for (uint32 i = 0; i < cols; i++) distance += (weight[i] - weights[other * cols + i]) * (weight[i] - weights[other * cols + i]);
+			if (sqrt(distance) < merge_distance) {
+				into = other;
+				break;
+			}
+		}
+
+		// Every unit before this one has been kept or folded in already, so moving it down can't clobber anything
+		float32* target = weights + into * cols;
+		if (into == kept) {
+			memmove(target, weight, cols * sizeof(float32));
+			if (som->unit_counts.size) som->unit_counts.data[into] = som->unit_counts.data[cluster];
+			kept++;
+		}
+		else {
+			float32 share = cluster_hits / (hits[into] + cluster_hits);
+			for (uint32 i = 0; i < cols; i++) target[i] += (weight[i] - target[i]) * share;
+			if (som->unit_counts.size) som->unit_counts.data[into] += som->unit_counts.data[cluster];
+		}
+		hits[into] += cluster_hits;
+		remap[cluster] = into;
+	}
+
+	// Nothing was trained on, so there's nothing to go on
+	if (!kept) {
+		for (uint32 cluster = 0; cluster < clusters; cluster++) remap[cluster] = cluster;
+		return clusters;
+	}
+
+	// Everything sized by unit shrinks with the weights, the workers' buffers included, so the SOM can go on
+	// training after it's compacted
+	som->weights.rows = kept;
+	som->deltas.rows = kept;
+	som->config.count_clusters = kept;
+	som->cluster_stats.size = kept;
+	if (som->unit_counts.size) som->unit_counts.size = kept;
+	if (som->is_sparse) {
+		som->weight_norms.size = kept;
+		som->delta_strength.size = kept;
+	}
+	arr_for(som->workers, worker) {
+		worker->deltas.rows = kept;
+		worker->stats.size = kept;
+		if (som->is_sparse) worker->delta_strength.size = kept;
+	}
+	arr_free(&som->probe_order);
+	if (som->metric == distance_metric::cosine) {
+		mtx_for(som->weights, weight) vec_normalize(weight);
+	}
+	if (som->is_soa) {
+		soa_free(som->soa_weights);
+		soa_init(&som->soa_weights, kept, cols);
+		soa_from_mtx(som->soa_weights, som->weights);
+	}
+
+	som_assign(som);
+	return kept;
+}
+
+// Find every input's winner against the weights as they are, without training, and gather the cluster stats
+void som_assign(som_t* som) {
+	cluster_stats_reset(&som->cluster_stats);
+	if (som->is_sparse) update_weight_norms(som);
+
+	vector_t& scratch = som->workers[0]->input_scratch;
+	for (uint32 row = 0; row < som->winners.size; row++) {
+		bmu_t bmu;
+		if (som->is_sparse) {
+			sparse_vector_t input = spm_at(som->sparse_inputs, row);
+			find_bmu(som, input, &bmu);
+		}
+		else if (som->is_half) {
+			hmtx_load(som->half_inputs, row, scratch);
+			som->kernels.find_bmu(som, scratch, &bmu);
+		}
+		else {
+			vector_t input = mtx_at(som->inputs, row);
+			som->kernels.find_bmu(som, input, &bmu);
+		}
+
+		som->winners[row] = bmu.winner;
+		som->distances[row] = bmu.distance;
+		cluster_stats_add(som->cluster_stats[bmu.winner], som_stats_distance(som, bmu.distance));
+	}
+}
+
+// Scoring
+struct som_predict_output_t {
+	uint32* winners;
+	float32* scores;
+	attribution_t* attributions;
+	uint32 top_k;
+};
+
+// Keep the top_k largest contributions, by insertion into a short sorted list; top_k is small, and most
+// features don't make the list, so they cost one compare
+void som_attribute(float32* contributions, uint32 features, attribution_t* out, uint32 top_k) {
+	float32 values [AD_ATTRIBUTION_MAX];
+	uint32 count = 0;
+	for (uint32 feature = 0; feature < features; feature++) {
+		float32 value = contributions[feature];
+		if (count == top_k && value <= values[count - 1]) continue;
+
+		uint32 i = count < top_k ? count++ : count - 1;
+		for (; i > 0 && values[i - 1] < value; i--) {
+			values[i] = values[i - 1];
+			out[i].feature = out[i - 1].feature;
+		}
+		values[i] = value;
+		out[i].feature = feature;
+	}
+
+	for (uint32 i = 0; i < count; i++) out[i].contribution = f32_to_f16(values[i]);
+	for (uint32 i = count; i < top_k; i++) {
+		out[i].feature = AD_ATTRIBUTION_NONE;
+		out[i].contribution = 0;
+	}
+}
+
+void som_predict_row(som_t* som, vector_t& input, uint32 row, som_predict_output_t* output, float32* contributions) {
+	vec_normalize(input);
+
+	bmu_t bmu;
+	som->kernels.find_bmu(som, input, &bmu);
+	output->winners[row] = bmu.winner;
+	output->scores[row] = bmu.distance;
+
+	if (output->top_k) {
+		float32* weight = som->weights.data + bmu.winner * som->weights.cols;
+		som->kernels.distance_contributions(som, input.data, weight, contributions);
+		som_attribute(contributions, input.size, output->attributions + row * output->top_k, output->top_k);
+	}
+}
+
+void som_predict(som_t* som, matrix_t& rows, uint32* winners, float32* scores, uint32 threads, attribution_t* attributions, uint32 top_k) {
+	som_predict_output_t output = { winners, scores, attributions, attributions ? top_k : 0 };
+	ad_parallel_for(rows.rows, threads, [&](uint32 begin, uint32 end, uint32) {
+		vector_t scratch;
+		vector_t contributions;
+		vec_init(&scratch, som->weights.cols);
+		vec_init(&contributions, output.top_k ? som->weights.cols : 0);
+		for (uint32 row = begin; row < end; row++) {
+			if (som->projection) proj_apply(som->projection, mtx_at(rows, row, 0), scratch.data);
+			else memcpy(scratch.data, mtx_at(rows, row, 0), rows.cols * sizeof(float32));
+			som_predict_row(som, scratch, row, &output, contributions.data);
+		}
+		vec_free(contributions);
+		vec_free(scratch);
+	});
+}
+
+// Sparse rows are expanded into a dense scratch row, so scoring uses the same kernels either way. With a
+// projection, they're projected straight from their nonzeros instead.
+void som_predict(som_t* som, sparse_matrix_t& rows, uint32* winners, float32* scores, uint32 threads, attribution_t* attributions, uint32 top_k) {
+	som_predict_output_t output = { winners, scores, attributions, attributions ? top_k : 0 };
+	ad_parallel_for(rows.rows, threads, [&](uint32 begin, uint32 end, uint32) {
+		vector_t scratch;
+		vector_t contributions;
+		vec_init(&scratch, som->weights.cols);
+		vec_init(&contributions, output.top_k ? som->weights.cols : 0);
+		for (uint32 row = begin; row < end; row++) {
+			sparse_vector_t input = spm_at(rows, row);
+			if (som->projection) {
+				proj_apply(som->projection, input, scratch.data);
+				som_predict_row(som, scratch, row, &output, contributions.data);
+				continue;
+			}
+			memset(scratch.data, 0, rows.cols * sizeof(float32));
+			spv_for(input, i) scratch[input.indices[i]] = input.values[i];
+			som_predict_row(som, scratch, row, &output, contributions.data);
+		}
+		vec_free(contributions);
+		vec_free(scratch);
+	});
+}
+
+// Threshold checks
+void som_probe_order(som_t* som, uint32* hits) {
+	uint32 clusters = som->weights.rows;
+	arr_free(&som->probe_order);
+	arr_init(&som->probe_order, clusters);
+	for (uint32 i = 0; i < clusters; i++) arr_push(&som->probe_order, i);
+
+	std::stable_sort(som->probe_order.data, som->probe_order.data + clusters, [&](uint32 a, uint32 b) {
+		return hits[a] > hits[b];
+	});
+}
+
+bool som_is_anomalous(som_t* som, vector_t& input, float32 threshold, uint32* last_hit) {
+	uint32 cols = som->weights.cols;
+	uint32 clusters = som->weights.rows;
+
+	if (*last_hit < clusters) {
+		if (som->kernels.distance_bounded(som, input.data, som->weights.data + *last_hit * cols, threshold) <= threshold) return false;
+	}
+
+	for (uint32 i = 0; i < clusters; i++) {
+		uint32 cluster = som->probe_order.size ? som->probe_order.data[i] : i;
+		if (cluster == *last_hit) continue;
+
+		if (som->kernels.distance_bounded(som, input.data, som->weights.data + cluster * cols, threshold) <= threshold) {
+			*last_hit = cluster;
+			return false;
+		}
+	}
+	return true;
+}
+
+void som_flag_anomalies(som_t* som, matrix_t& rows, float32 threshold, uint8* flags, uint32 threads) {
+	ad_parallel_for(rows.rows, threads, [&](uint32 begin, uint32 end, uint32) {
+		vector_t scratch;
+		vec_init(&scratch, som->weights.cols);
+		uint32 last_hit = 0;
+		for (uint32 row = begin; row < end; row++) {
+			if (som->projection) proj_apply(som->projection, mtx_at(rows, row, 0), scratch.data);
+			else memcpy(scratch.data, mtx_at(rows, row, 0), rows.cols * sizeof(float32));
+			vec_normalize(scratch);
+			flags[row] = som_is_anomalous(som, scratch, threshold, &last_hit);
+		}
+		vec_free(scratch);
+	});
 }
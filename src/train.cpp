@@ -13,35 +13,91 @@
 #include "som.hpp"
 #include "platform.hpp"
 #include "pipeline.hpp"
+#include "checkpoint.hpp"
+#include "model.hpp"
+#include "kmeans.hpp"
+#include "projection.hpp"
 
 #define AD_FLAG_CONFIG "-c"
+#define AD_FLAG_RESUME "-r"
+#define AD_FLAG_WARM "-w"
 #define AD_FLAG_HELP "-h"
 
-void ad_train(som_t& som, ad_featurized_header* header, float32* input_data) {
-	// Initialize the algorithm
-	uint32 rows = header->rows;
-	uint32 cols = header->features_per_row;
-	som_init(&som, input_data, rows, cols);
-	
-	// Loop: Find each point's winning cluster, and then adjust this cluster and neighboring
-	// clusters to be closer to this point. Break when MSE reaches a threshold.
-	uint32 i = 0;
+void ad_train_loop(som_t& som, const char* resume_path, const char* warm_path) {
 	float32 last_error = FLT_MAX;
+	if (warm_path) {
+		ad_model_t model;
+		if (model_load(&model, warm_path) || model_warm_start(&som, &model)) {
+			fprintf(stderr, "cannot warm start from model, path = %s\n", warm_path);
+			exit(1);
+		}
+		model_free(&model);
+		if (!som.config.quiet && som.engine == som_engine::kmeans) printf("warm starting from model\n");
+		else if (!som.config.quiet) printf("warm starting from model, learning_rate = %f, decay_rate = %f, radius = %f\n", som.config.learning_rate, som.config.decay_rate, som.radius);
+	}
+	if (resume_path) {
+		if (ckpt_load(&som, resume_path, &last_error)) {
+			fprintf(stderr, "cannot resume from checkpoint, path = %s\n", resume_path);
+			exit(1);
+		}
+		if (!som.config.quiet) printf("resuming from checkpoint, iteration = %d\n", som.iteration);
+	}
+
+	// k-means starts from inputs rather than random weights, unless it's picking up from earlier weights
+	bool kmeans = som.engine == som_engine::kmeans;
+	if (kmeans && !warm_path && !resume_path) kmeans_seed(&som);
+
+	// Checkpoints are written every checkpoint_interval epochs, if there's somewhere to write them
+	checkpoint_writer_t checkpoints;
+	bool checkpoint = strlen(som.config.checkpoint_file) && som.config.checkpoint_interval;
+	if (checkpoint) {
+		char checkpoint_path [AD_PATH_SIZE];
+		paths::ad_data(som.config.checkpoint_file, checkpoint_path, AD_PATH_SIZE);
+		ckpt_writer_init(&checkpoints, checkpoint_path);
+	}
+
+	// Loop: Find each point's winning cluster, and then adjust this cluster and neighboring
+	// clusters to be closer to this point. Break when MSE reaches a threshold. The error is measured
+	// during the pass, so it describes the weights each epoch started with.
+	uint32 i = som.iteration;
 	while (true) {
-		som_iterate(&som);
-		apply_deltas(&som);
+		som_epoch_t epoch = kmeans ? kmeans_iterate(&som) : som_iterate(&som);
+		float32 learning_rate = decayed_learning_rate(&som);
+		if (!kmeans) apply_deltas(&som);
 
-		float32 error = som_error(&som);
+		float32 error = epoch.quantization_error;
 		float32 delta_error = abs(error - last_error);
 		last_error = error;
 
-		if (!som.config.quiet) {
-			printf("iteration = %d, error = %f, learning_rate = %f\n", i++, error, decayed_learning_rate(&som));
+		if (!som.config.quiet && kmeans) {
+			printf("iteration = %d, error = %f\n", i++, error);
+		}
+		else if (!som.config.quiet) {
+			printf("iteration = %d, error = %f, topographic_error = %f, learning_rate = %f\n", i++, error, epoch.topographic_error, learning_rate);
 		}
 		
 		if (delta_error < som.config.error_threshold) {
 			break;
 		}
+
+		if (checkpoint && som.iteration % som.config.checkpoint_interval == 0) {
+			ckpt_save(&checkpoints, &som, last_error);
+		}
+	}
+	ckpt_writer_wait(&checkpoints);
+
+	// Scoring cost is linear in the number of units, so drop the ones that don't earn their keep
+	if (som.config.compact) {
+		uint32 clusters = som.weights.rows;
+		std::vector<uint32> remap(clusters);
+		uint32 kept = som_compact(&som, som.config.merge_distance, remap.data());
+		if (!som.config.quiet) printf("compacted %d units to %d\n", clusters, kept);
+	}
+
+	if (som.config.write_output && strlen(som.config.results_file)) {
+		char model_path [AD_PATH_SIZE];
+		paths::ad_data(som.config.results_file, model_path, AD_PATH_SIZE);
+		if (model_save(&som, model_path)) fprintf(stderr, "cannot write model, path = %s\n", model_path);
 	}
 
 	if (!som.config.quiet) {
@@ -52,20 +108,103 @@ void ad_train(som_t& som, ad_featurized_header* header, float32* input_data) {
 			uint32 cluster = mtx_indexof(som.weights, weight);
 			printf("cluster %d: (%f, %f, %f, %f)\n", cluster, weight[0], weight[1], weight[2], weight[3]);
 		}
+		arr_for(som.cluster_stats, stats) {
+			uint32 cluster = arr_indexof(&som.cluster_stats, stats);
+			printf("cluster %d: hits = %d, mean distance = %f, stddev = %f, radius = %f\n",
+				   cluster, stats->hits, stats->mean, sqrt(cluster_stats_variance(stats)), stats->radius);
+		}
 		
 		printf("done\n");
 	}
 }
 
-void ad_train(som_t& som) {
+void ad_normalize_rows(matrix_t& rows) {
+	mtx_for(rows, row) vec_normalize(row);
+}
+
+void ad_normalize_rows(sparse_matrix_t& rows) {
+	spm_for(rows, row) vec_normalize(row);
+}
+
+// With a reduction in the config, the map trains on projections of the inputs instead of the inputs. Rows are
+// normalized first, so PCA fits their directions rather than their lengths; the projections are dense however
+// the inputs were stored, and som_init normalizes them again. Resuming from a checkpoint or warm starting
+// from a reduced model reuses the projection saved with it, so the weights it starts from are in the same
+// space; fitting again could pick a different basis. The projection stays with the SOM for model_save and
+// ckpt_save, and like the projected rows, it lives as long as the process.
+template<typename M>
+float32* ad_reduce(som_t& som, M& inputs, const char* resume_path, const char* warm_path) {
+	if (!strlen(som.config.reduction)) return nullptr;
+
+	// Normalized the same way whether the projection is fitted or reused, so resumed runs see the same rows
+	ad_normalize_rows(inputs);
+	projection_t* projection = new projection_t;
+	bool reduced = false;
+	if (resume_path) {
+		reduced = !ckpt_load_projection(projection, resume_path) && projection->kind != projection_kind::none && projection->input_cols == inputs.cols;
+		if (!reduced) proj_free(projection);
+	}
+	if (warm_path) {
+		ad_model_t model;
+		if (!model_load(&model, warm_path) && model.projection.kind != projection_kind::none && model.projection.input_cols == inputs.cols) {
+			proj_copy(projection, &model.projection);
+			reduced = true;
+		}
+		model_free(&model);
+	}
+
+	if (!reduced) reduced = proj_fit(projection, &som.config, inputs, som.config.threads);
+	if (!reduced) {
+		delete projection;
+		return nullptr;
+	}
+
+	float32* output = (float32*)calloc((uint64)inputs.rows * projection->output_cols, sizeof(float32));
+	proj_rows(projection, inputs, output, som.config.threads);
+	som.projection = projection;
+
+	if (!som.config.quiet && projection->explained) {
+		printf("reduced %d features to %d, keeping %.1f%% of the variance\n", projection->input_cols, projection->output_cols, 100 * projection->explained);
+	}
+	else if (!som.config.quiet) {
+		printf("reduced %d features to %d\n", projection->input_cols, projection->output_cols);
+	}
+	return output;
+}
+
+void ad_train(som_t& som, ad_featurized_header* header, float32* input_data, const char* resume_path, const char* warm_path) {
+	// Initialize the algorithm
+	uint32 rows = header->rows;
+	uint32 cols = header->features_per_row;
+	matrix_t inputs;
+	mtx_init(&inputs, input_data, rows, cols);
+	float32* reduced = ad_reduce(som, inputs, resume_path, warm_path);
+	if (reduced) som_init(&som, reduced, rows, som.projection->output_cols);
+	else som_init(&som, input_data, rows, cols);
+
+	ad_train_loop(som, resume_path, warm_path);
+}
+
+void ad_train(som_t& som, ad_featurized_header* header, sparse_matrix_t* inputs, const char* resume_path, const char* warm_path) {
+	float32* reduced = ad_reduce(som, *inputs, resume_path, warm_path);
+	if (reduced) som_init(&som, reduced, inputs->rows, som.projection->output_cols);
+	else som_init(&som, inputs);
+
+	ad_train_loop(som, resume_path, warm_path);
+}
+
+void ad_train(som_t& som, const char* resume_path, const char* warm_path) {
 	// Load the binary input
 	char featurized_data_path [AD_PATH_SIZE];
 	paths::ad_data(som.config.featurized_data_file, featurized_data_path, AD_PATH_SIZE);
 				   
 	FILE* file = fopen(featurized_data_path, "r");
-	if (!file) fprintf(stderr, "cannot open input file, path = %s\n", featurized_data_path);
+	if (!file) {
+		fprintf(stderr, "cannot open input file, path = %s\n", featurized_data_path);
+		exit(1);
+	}
 	fseek(file, 0, SEEK_END);
-	uint32 file_size = ftell(file);
+	uint64 file_size = ftell(file);
 	fseek(file, 0, SEEK_SET);
 
 	char* buffer = (char*)calloc(sizeof(char), file_size);
@@ -73,11 +212,23 @@ void ad_train(som_t& som) {
 	fclose(file);
 
 	// Deserialize the binary input. It's serialized very simply -- just a header,
-	// and then a tighly packed array of floats.
+	// and then a tighly packed array of floats (or the CSR arrays, for sparse data)
     ad_featurized_header* header = (ad_featurized_header*)buffer;
+	if (!featurized_valid(header, file_size, featurized_data_path)) exit(1);
+	if (header->layout == ad_featurized_layout::ad_sparse) {
+		uint32* offsets = (uint32*)(buffer + sizeof(ad_featurized_header));
+		uint32* columns = offsets + header->rows + 1;
+		float32* values = (float32*)(columns + header->nonzeros);
+
+		sparse_matrix_t inputs;
+		spm_init(&inputs, values, columns, offsets, header->rows, header->features_per_row);
+		ad_train(som, header, &inputs, resume_path, warm_path);
+		return;
+	}
+
 	float32* input_data = (float32*)(buffer + sizeof(ad_featurized_header));
 
-	ad_train(som, header, input_data);
+	ad_train(som, header, input_data, resume_path, warm_path);
 }
 
 #ifndef AD_GUI
@@ -85,10 +236,15 @@ const char* help =
 	"ad_train: train a model on a featurized dataset\n\n"
 	
 	"usage:\n"
-	"  -c [config_path]: required, path to a config file";
+	"  -c [config_path]: required, path to a config file\n"
+	"  -r [checkpoint_file]: resume training from a checkpoint written by an earlier run, named like checkpoint_file in the data directory\n"
+	"  -w [model_path]: start from the weights of a model written by an earlier run, with the warm learning rate and radius";
 
 int main(int arg_count, char** args) {
 	char config_path [AD_PATH_SIZE] = { 0 };
+	char resume_file [AD_PATH_SIZE] = { 0 };
+	char resume_path [AD_PATH_SIZE] = { 0 };
+	char warm_path   [AD_PATH_SIZE] = { 0 };
 
 	// Parse arguments and check for validity
 	for (int32 i = 1; i < arg_count; i++) {
@@ -97,22 +253,34 @@ int main(int arg_count, char** args) {
 			char* arg = args[++i];
 			strncpy(config_path, arg, AD_PATH_SIZE);
 		}
+		else if (!strcmp(flag, AD_FLAG_RESUME)) {
+			char* arg = args[++i];
+			strncpy(resume_file, arg, AD_PATH_SIZE);
+		}
+		else if (!strcmp(flag, AD_FLAG_WARM)) {
+			char* arg = args[++i];
+			strncpy(warm_path, arg, AD_PATH_SIZE);
+		}
 		else if (!strcmp(flag, AD_FLAG_HELP)) {
 			printf("%s\n", help);
 			exit(0);
 		}
 	}
 
-	if (!strlen(config_path)) {
+	// A checkpoint already has its own weights, so there's nothing to warm start
+	if (!strlen(config_path) || (strlen(resume_file) && strlen(warm_path))) {
 		printf("%s\n", help);
 		exit(1);
 	}
 
 	init_paths();
+
+	// Checkpoints are written to checkpoint_file under the data directory, so they're found the same way
+	if (strlen(resume_file)) paths::ad_data(resume_file, resume_path, AD_PATH_SIZE);
 	
 	som_t som;
 	cfg_load(&som.config, config_path);
 	
-	ad_train(som);
+	ad_train(som, strlen(resume_path) ? resume_path : nullptr, strlen(warm_path) ? warm_path : nullptr);
 }
 #endif
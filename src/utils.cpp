@@ -1,6 +1,11 @@
 #include <cstring>
+#include <cstdlib>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 #include "array.hpp"
+#include "utils.hpp"
 
 void memfill(void* dst, int32 size, void* pattern, int32 pattern_size) {
 	char* cdst = (char*)dst;
@@ -13,3 +18,36 @@ void memfill(void* dst, int32 size, void* pattern, int32 pattern_size) {
 		i += pattern_size;
 	}
 }
+
+void* ad_aligned_alloc(uint64 size, uint64 alignment) {
+	size = ad_align(size, alignment);
+#ifdef _WIN32
+	void* data = _aligned_malloc(size, alignment);
+#else
+	void* data = aligned_alloc(alignment, size);
+#endif
+	if (data) memset(data, 0, size);
+	return data;
+}
+
+void ad_aligned_free(void* data) {
+#ifdef _WIN32
+	_aligned_free(data);
+#else
+	free(data);
+#endif
+}
+
+uint64 ad_align(uint64 value, uint64 alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+// 64 bit FNV-1a. Pass the previous result as hash to checksum data in pieces.
+uint64 ad_hash(const void* data, uint64 size, uint64 hash) {
+	const uint8* bytes = (const uint8*)data;
+	for (uint64 i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3;
+	}
+	return hash;
+}